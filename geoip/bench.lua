@@ -0,0 +1,162 @@
+#! /usr/bin/env lua
+-- vim:sw=4:sts=4
+--
+-- Benchmark of the lookup functions.  Usage:
+--
+--  lua bench.lua [database file] [number of lookups]
+--
+-- Without a file name, the default city database of libGeoIP is used.  Each
+-- scenario is run for each cache mode and each lookup function, and prints
+-- one line with the time per lookup and the lookups per second.
+
+geoip = require "geoip"
+
+local path = arg[1]
+local N = tonumber(arg[2]) or 200000
+local BATCH = 1000
+
+local modes = {
+    { "standard", { cache="standard" } },
+    { "index", { cache="index" } },
+    { "memory", { cache="memory" } },
+    { "mmap", { cache="mmap" } },
+    { "memory+lru", { cache="memory", cache_entries=4096 } },
+}
+
+local function open(opt)
+    if path then
+	return geoip.open(path, opt)
+    end
+    return geoip.open_type("city", opt)
+end
+
+local function random_ip()
+    return string.format("%d.%d.%d.%d", math.random(1, 223),
+	math.random(0, 255), math.random(0, 255), math.random(1, 254))
+end
+
+-- n addresses drawn uniformly at random
+local function random_set(n)
+    local ips = {}
+    for i = 1, n do
+	ips[i] = random_ip()
+    end
+    return ips
+end
+
+-- n addresses from 10000 distinct ones, with Zipf distributed frequencies
+local function zipf_set(n)
+    local distinct, cum, total = random_set(10000), {}, 0
+    for k = 1, #distinct do
+	total = total + 1 / k
+	cum[k] = total
+    end
+
+    local ips = {}
+    for i = 1, n do
+	local x, lo, hi = math.random() * total, 1, #cum
+	while lo < hi do
+	    local mid = math.floor((lo + hi) / 2)
+	    if cum[mid] < x then lo = mid + 1 else hi = mid end
+	end
+	ips[i] = distinct[lo]
+    end
+    return ips
+end
+
+-- the lookup functions, each running over a whole array of addresses
+local apis = {
+    { "lookup", function(g, ips)
+	local lookup = g.lookup
+	for i = 1, #ips do
+	    lookup(g, ips[i])
+	end
+    end },
+    { "lookup_many", function(g, ips)
+	local batch = {}
+	for i = 1, #ips, BATCH do
+	    local n = math.min(BATCH, #ips - i + 1)
+	    for j = 1, BATCH do
+		batch[j] = j <= n and ips[i + j - 1] or nil
+	    end
+	    g:lookup_many(batch)
+	end
+    end },
+    { "prepare", function(g, ips)
+	local q = g:prepare{ "country_code" }
+	for i = 1, #ips do
+	    q(ips[i])
+	end
+    end },
+}
+
+local function report(scenario, mode, api, n, t)
+    print(string.format("%-12s %-11s %-12s %10.3f us %12.0f /s",
+	scenario, mode, api, t / n * 1e6, t > 0 and n / t or 0))
+end
+
+local function time(f, ...)
+    collectgarbage("collect")
+    local t0 = os.clock()
+    f(...)
+    return os.clock() - t0
+end
+
+-- resident set size in KB, if available
+local function rss()
+    local f = io.open("/proc/self/statm")
+    if not f then return 0 end
+    local pages = f:read("*n") and f:read("*n")
+    f:close()
+    return (pages or 0) * 4
+end
+
+local sets = {
+    { "random", random_set(N) },
+    { "zipf", zipf_set(N) },
+}
+local single = {}
+for i = 1, N do single[i] = "74.125.67.100" end
+
+for _, mode in ipairs(modes) do
+    local name, opt = mode[1], mode[2]
+    local ok, g = pcall(open, opt)
+    if not ok then
+	print(string.format("%-12s %-11s skipped: %s", "", name, g))
+    else
+	for _, api in ipairs(apis) do
+	    local ok, err = pcall(function()
+		report("latency", name, api[1], N, time(api[2], g, single))
+		for _, set in ipairs(sets) do
+		    report(set[1], name, api[1], N, time(api[2], g, set[2]))
+		end
+	    end)
+	    if not ok then
+		print(string.format("%-12s %-11s %-12s skipped: %s", "", name,
+		    api[1], err))
+	    end
+	end
+
+	local r = g:lookup("74.125.67.100")
+	if r then
+	    report("field", name, "index", N, time(function()
+		for i = 1, N do local _ = r.country_code end
+	    end))
+	    report("tostring", name, "tostring", N, time(function()
+		for i = 1, N do tostring(r) end
+	    end))
+	end
+
+	-- growth of memory (Lua heap and process) after a million lookups
+	local ips = sets[1][2]
+	collectgarbage("collect")
+	local lua0, rss0 = collectgarbage("count"), rss()
+	for i = 1, 1000000 do
+	    g:lookup(ips[(i - 1) % #ips + 1])
+	end
+	collectgarbage("collect")
+	print(string.format("%-12s %-11s %-12s %10.0f KB Lua %8.0f KB RSS",
+	    "growth", name, "lookup", collectgarbage("count") - lua0,
+	    rss() - rss0))
+    end
+end
@@ -9,11 +9,27 @@
  * version 2 of the License, or (at your option) any later version.
  */
 
+#ifdef HAVE_GETADDRINFO_A
+#define _GNU_SOURCE	/* for getaddrinfo_a */
+#endif
 #include <GeoIPCity.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include <lualib.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
 
 
 /**
@@ -23,19 +39,26 @@
 struct result_t;
 typedef struct _field_t {
     const char *name;		/* name of the field */
-    int mode;
+    int mode;			/* see _access_field */
     int offset;
     int (*callback)(lua_State *L, struct result_t *r, struct _field_t *f);
+    const char *(*text)(struct result_t *r, struct _field_t *f, char *buf);
+    struct _field_t *sub;	/* field of a member database (sets only) */
 } Field;
 
+/* size of the buffer given to the text function of a field */
+#define TEXT_SIZE 32
+
 
 /**
  * One such structure exists per database type.
  */
 typedef struct {
     Field *fields;	/* array of field definitions */
+    int n_fields;	/* set when the module is loaded */
     void (*gc)(lua_State *L, struct result_t *r);
     int (*tostring)(lua_State *L, struct result_t *r);
+    size_t (*pack)(struct result_t *r, void *buf);	/* may be NULL */
 } ResultMeta;
 
 
@@ -45,14 +68,26 @@ typedef struct {
  *
  * Depending on the database used, one of the fields is filled in.  Most of the
  * fields can be read with the appropriate __index method.
+ *
+ * Result objects of the city and region databases are packed: the record
+ * and its strings are copied into the userdata right after the Result, and
+ * data points there.  See _pack_result.
  */
 typedef struct result_t {
     ResultMeta *meta;
     void *data;		/* some token returned by libGeoIP */
+    int cached;		/* shared, e.g. by the lookup cache of a GeoIP object */
 } Result;
 
+/*
+ * Result objects created and collected, for the whole process.  They are
+ * updated by all Lua states, so only with atomic operations.
+ */
+static unsigned long results_created, results_freed;
+
 #define RESULT	"GeoIPResult"
 #define GEOIP "GeoIP"
+#define GEOIPSET "GeoIPSet"
 
 
 /**
@@ -68,17 +103,68 @@ static int _push_opt_string(lua_State *L, const char *s)
     return 0;
 }
 
+/**
+ * Callback for fields whose value is a string; it is produced by the text
+ * function of the field.
+ */
+static int _text_access(lua_State *L, Result *r, Field *f)
+{
+    char buf[TEXT_SIZE];
+    return _push_opt_string(L, f->text(r, f, buf));
+}
+
+/**
+ * Push a string from the static arrays of libGeoIP.  The Lua strings are kept
+ * in the environment of this module with the address of the C string as key,
+ * so they are not hashed again on each access.  The country strings are put
+ * there when the module is loaded, others like time zones on first use.
+ */
+static int _push_static_string(lua_State *L, const char *s)
+{
+    if (!s)
+	return 0;
+
+    lua_pushlightuserdata(L, (void*) s);
+    lua_rawget(L, LUA_ENVIRONINDEX);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
+	lua_pushlightuserdata(L, (void*) s);
+	lua_pushstring(L, s);
+	lua_pushvalue(L, -1);
+	lua_insert(L, -3);
+	lua_rawset(L, LUA_ENVIRONINDEX);
+    }
+    return 1;
+}
+
+/* like _text_access for fields whose text is static */
+static int _static_access(lua_State *L, Result *r, Field *f)
+{
+    char buf[TEXT_SIZE];
+    return _push_static_string(L, f->text(r, f, buf));
+}
+
 static int _access_field(lua_State *L, Result *r, Field *f)
 {
     char *p = (char*) r->data;
 
     switch (f->mode) {
+	/* char* at offset */
 	case 1:
 	return _push_opt_string(L, * (char**) (p + f->offset));
 	
+	/* float at offset */
 	case 2:
 	lua_pushnumber(L, * (float*) (p + f->offset));
 	return 1;
+
+	/* char array */
+	case 4:
+	return _push_opt_string(L, p + f->offset);
+
+	/* char* at offset into a static array of libGeoIP */
+	case 5:
+	return _push_static_string(L, * (char**) (p + f->offset));
 	
 	/* callback */
 	case 3:
@@ -88,21 +174,120 @@ static int _access_field(lua_State *L, Result *r, Field *f)
     return 0;
 }
 
+/**
+ * Get the value of a field as a C string without creating a Lua value.
+ * Numbers are formatted into buf, which has TEXT_SIZE bytes.
+ *
+ * @return  The text, or NULL if the field is not set.
+ */
+static const char *_field_text(Result *r, Field *f, char *buf)
+{
+    char *p = (char*) r->data;
+
+    switch (f->mode) {
+	case 1:
+	case 5:
+	return * (char**) (p + f->offset);
+
+	case 2:
+	snprintf(buf, TEXT_SIZE, LUA_NUMBER_FMT,
+	    (lua_Number) * (float*) (p + f->offset));
+	return buf;
+
+	case 3:
+	return f->text(r, f, buf);
+
+	case 4:
+	return p + f->offset;
+    }
+
+    return NULL;
+}
+
+
+/* --------- region names and time zones ------------ */
+
+/*
+ * GeoIP_region_name_by_code and GeoIP_time_zone_by_country_and_region
+ * compare the codes with long lists of strings, so their results are kept
+ * here by country and region code.  A slot is filled once and never changed
+ * or freed, so it can be read by several threads without a lock; when two
+ * pairs of codes share a slot, the second one isn't cached.
+ */
+
+#define REGION_SLOTS 4096
+
+typedef struct {
+    unsigned int key;
+    const char *region_name;
+    const char *time_zone;
+} RegionInfo;
+
+static RegionInfo *region_infos[REGION_SLOTS];
+
+/**
+ * @return  The region name and time zone for a country and region code,
+ *  or NULL if the codes are too long or the memory is exhausted.
+ */
+static const RegionInfo *_region_info(const char *cc, const char *region)
+{
+    unsigned int key, slot;
+    RegionInfo *ri;
+
+    if (!cc || !cc[0] || !cc[1] || cc[2] || (region && region[0]
+	&& region[1] && region[2]))
+	return NULL;
+
+    /* a code has two characters; a missing region is marked with 0xff */
+    key = (unsigned char) cc[0] << 24 | (unsigned char) cc[1] << 16;
+    if (!region)
+	key |= 0xff00;
+    else if (region[0])
+	key |= (unsigned char) region[0] << 8 | (unsigned char) region[1];
+    slot = (key * 2654435761u) >> 20 & (REGION_SLOTS - 1);
+
+    if ((ri = region_infos[slot]))
+	return ri->key == key ? ri : NULL;
+
+    if (!(ri = (RegionInfo*) malloc(sizeof(*ri))))
+	return NULL;
+    ri->key = key;
+    ri->region_name = GeoIP_region_name_by_code(cc, region);
+    ri->time_zone = GeoIP_time_zone_by_country_and_region(cc, region);
+    if (!__sync_bool_compare_and_swap(&region_infos[slot], NULL, ri)) {
+	free(ri);
+	ri = region_infos[slot];
+	return ri->key == key ? ri : NULL;
+    }
+    return ri;
+}
+
+static const char *_region_name(const char *cc, const char *region)
+{
+    const RegionInfo *ri = _region_info(cc, region);
+    return ri ? ri->region_name : GeoIP_region_name_by_code(cc, region);
+}
+
+static const char *_time_zone(const char *cc, const char *region)
+{
+    const RegionInfo *ri = _region_info(cc, region);
+    return ri ? ri->time_zone
+	: GeoIP_time_zone_by_country_and_region(cc, region);
+}
+
 
 /* --------- city database ------------ */
 
-static int city_region_name(lua_State *L, Result *r, Field *f)
+static const char *city_region_name(Result *r, Field *f, char *buf)
 {
     GeoIPRecord *g = (GeoIPRecord*) r->data;
-    return _push_opt_string(L, GeoIP_region_name_by_code(
-	g->country_code, g->region));
+    return _region_name(g->country_code, g->region);
 }
 
-static int city_time_zone(lua_State *L, Result *r, Field *f)
+static const char *city_time_zone(Result *r, Field *f, char *buf)
 {
     GeoIPRecord *g = (GeoIPRecord*) r->data;
-    return _push_opt_string(L, GeoIP_time_zone_by_country_and_region(
-	g->country_code, g->region));
+    return _time_zone(g->country_code, g->region);
 }
 
 static Field city_fields[] = {
@@ -110,12 +295,12 @@ static Field city_fields[] = {
     { "postal_code", 1, offsetof(GeoIPRecord, postal_code) },
     { "latitude", 2, offsetof(GeoIPRecord, latitude) },
     { "longitude", 2, offsetof(GeoIPRecord, longitude) },
-    { "country", 1, offsetof(GeoIPRecord, country_name) },
-    { "country_code", 1, offsetof(GeoIPRecord, country_code) },
+    { "country", 5, offsetof(GeoIPRecord, country_name) },
+    { "country_code", 5, offsetof(GeoIPRecord, country_code) },
     { "region", 1, offsetof(GeoIPRecord, region) },
-    { "continent", 1, offsetof(GeoIPRecord, continent_code) },
-    { "region_name", 3, 0, city_region_name },
-    { "time_zone", 3, 0, city_time_zone },
+    { "continent", 5, offsetof(GeoIPRecord, continent_code) },
+    { "region_name", 3, 0, _static_access, city_region_name },
+    { "time_zone", 3, 0, _static_access, city_time_zone },
     { NULL, 0, 0 },
 };
 
@@ -127,9 +312,47 @@ static int city_tostring(lua_State *L, Result *r)
     return 1;
 }
 
+/* copy a string for a packed record and advance p */
+static char *_pack_string(char **p, const char *s)
+{
+    char *copy = *p;
+    size_t len;
+
+    if (!s)
+	return NULL;
+    len = strlen(s) + 1;
+    memcpy(copy, s, len);
+    *p += len;
+    return copy;
+}
+
+/* the other strings point to static arrays of libGeoIP */
+static size_t city_pack(Result *r, void *buf)
+{
+    GeoIPRecord *g = (GeoIPRecord*) r->data, *out = (GeoIPRecord*) buf;
+    char *p;
+
+    if (!buf)
+	return sizeof(*g) + (g->region ? strlen(g->region) + 1 : 0)
+	    + (g->city ? strlen(g->city) + 1 : 0)
+	    + (g->postal_code ? strlen(g->postal_code) + 1 : 0);
+
+    *out = *g;
+    p = (char*) (out + 1);
+    out->region = _pack_string(&p, g->region);
+    out->city = _pack_string(&p, g->city);
+    out->postal_code = _pack_string(&p, g->postal_code);
+    return p - (char*) buf;
+}
+
+static int _is_packed(Result *r)
+{
+    return r->data == (void*) (r + 1);
+}
+
 static void city_gc(lua_State *L, Result *r)
 {
-    if (r->data) {
+    if (r->data && !_is_packed(r)) {
 	GeoIPRecord_delete((GeoIPRecord*) r->data);
 	r->data = NULL;
     }
@@ -145,22 +368,57 @@ static country_func country_funcs[] = {
     GeoIP_continent_by_id
 };
 
+static const char *country_field_text(Result *r, Field *f, char *buf)
+{
+    int id = (int) (intptr_t) r->data;
+    return country_funcs[f->offset](id);
+}
+
+/* the strings of country id are at 3 * id + 1, 2, 3 in the environment */
 static int country_field_access(lua_State *L, Result *r, Field *f)
 {
-    int id = (int) r->data;
-    return _push_opt_string(L, country_funcs[f->offset](id));
+    int id = (int) (intptr_t) r->data;
+
+    lua_rawgeti(L, LUA_ENVIRONINDEX, 3 * id + f->offset + 1);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
+	return 0;
+    }
+    return 1;
+}
+
+/**
+ * Put the strings of all countries into the environment, by id for
+ * country_field_access and by address for _push_static_string.
+ */
+static void _register_countries(lua_State *L)
+{
+    const char *s;
+    int id, k;
+
+    for (id=0; GeoIP_code_by_id(id); id++) {
+	for (k=0; k<3; k++) {
+	    if (!(s = country_funcs[k](id)))
+		continue;
+	    lua_pushlightuserdata(L, (void*) s);
+	    lua_pushstring(L, s);
+	    lua_pushvalue(L, -1);
+	    lua_rawseti(L, LUA_ENVIRONINDEX, 3 * id + k + 1);
+	    lua_rawset(L, LUA_ENVIRONINDEX);
+	}
+    }
 }
 
 static Field country_fields[] = {
-    { "country", 3, 0, country_field_access },
-    { "country_code", 3, 1, country_field_access },
-    { "continent", 3, 2, country_field_access },
+    { "country", 3, 0, country_field_access, country_field_text },
+    { "country_code", 3, 1, country_field_access, country_field_text },
+    { "continent", 3, 2, country_field_access, country_field_text },
     { NULL },
 };
 
 static int country_tostring(lua_State *L, Result *r)
 {
-    int id = (int) r->data;
+    int id = (int) (intptr_t) r->data;
     lua_pushfstring(L, "%s (%s)", GeoIP_name_by_id(id), GeoIP_code_by_id(id));
     return 1;
 }
@@ -171,17 +429,16 @@ static void country_gc(lua_State *L, Result *r)
 
 /* ---------- region database ----------- */
 
-static int region_time_zone(lua_State *L, Result *r, Field *f)
+static const char *region_time_zone(Result *r, Field *f, char *buf)
 {
     GeoIPRegion *g = (GeoIPRegion*) r->data;
-    return _push_opt_string(L, GeoIP_time_zone_by_country_and_region(
-	g->country_code, g->region));
+    return _time_zone(g->country_code, g->region);
 }
 
 static Field region_fields[] = {
-    { "country_code", 1, offsetof(GeoIPRegion, country_code) },
-    { "region", 1, offsetof(GeoIPRegion, region) },
-    { "time_zone", 3, 0, region_time_zone },
+    { "country_code", 4, offsetof(GeoIPRegion, country_code) },
+    { "region", 4, offsetof(GeoIPRegion, region) },
+    { "time_zone", 3, 0, _static_access, region_time_zone },
     { NULL },
 };
 
@@ -192,21 +449,189 @@ static int region_tostring(lua_State *L, Result *r)
     return 1;
 }
 
+static size_t region_pack(Result *r, void *buf)
+{
+    if (buf)
+	memcpy(buf, r->data, sizeof(GeoIPRegion));
+    return sizeof(GeoIPRegion);
+}
+
 static void region_gc(lua_State *L, Result *r)
 {
-    if (r->data) {
+    if (r->data && !_is_packed(r)) {
 	GeoIPRegion_delete((GeoIPRegion*)r->data);
 	r->data = NULL;
     }
 }
 
 
+/* ---------- org, isp and asnum databases ----------- */
+
+/* data is the string returned by GeoIP_name_by_* */
+static const char *org_name(Result *r, Field *f, char *buf)
+{
+    return (const char*) r->data;
+}
+
+static Field org_fields[] = {
+    { "name", 3, 0, _text_access, org_name },
+    { NULL },
+};
+
+static int org_tostring(lua_State *L, Result *r)
+{
+    lua_pushstring(L, (const char*) r->data);
+    return 1;
+}
+
+static void org_gc(lua_State *L, Result *r)
+{
+    if (r->data) {
+	free(r->data);
+	r->data = NULL;
+    }
+}
+
+/* the string looks like "AS15169 Google Inc." */
+static int asnum_asn(lua_State *L, Result *r, Field *f)
+{
+    const char *s = (const char*) r->data;
+
+    if (strncmp(s, "AS", 2) || s[2] < '0' || s[2] > '9')
+	return 0;
+    lua_pushnumber(L, strtoul(s + 2, NULL, 10));
+    return 1;
+}
+
+static const char *asnum_asn_text(Result *r, Field *f, char *buf)
+{
+    const char *s = (const char*) r->data;
+
+    if (strncmp(s, "AS", 2) || s[2] < '0' || s[2] > '9')
+	return NULL;
+    snprintf(buf, TEXT_SIZE, "%lu", strtoul(s + 2, NULL, 10));
+    return buf;
+}
+
+static const char *asnum_name(Result *r, Field *f, char *buf)
+{
+    const char *s = strchr((const char*) r->data, ' ');
+    return s ? s + 1 : NULL;
+}
+
+static Field asnum_fields[] = {
+    { "asn", 3, 0, asnum_asn, asnum_asn_text },
+    { "name", 3, 0, _text_access, asnum_name },
+    { "asnum", 3, 0, _text_access, org_name },
+    { NULL },
+};
+
+/* ---------- netspeed database ----------- */
+
+static const char *netspeed_names[] = {
+    "Unknown", "Dialup", "Cable/DSL", "Corporate"
+};
+
+static int netspeed_field_access(lua_State *L, Result *r, Field *f)
+{
+    int id = (int) (intptr_t) r->data;
+
+    if (f->offset)
+	lua_pushinteger(L, id);
+    else if (id >= 0 && id <= GEOIP_CORPORATE_SPEED)
+	lua_pushstring(L, netspeed_names[id]);
+    else
+	return 0;
+    return 1;
+}
+
+static const char *netspeed_field_text(Result *r, Field *f, char *buf)
+{
+    int id = (int) (intptr_t) r->data;
+
+    if (f->offset) {
+	snprintf(buf, TEXT_SIZE, "%d", id);
+	return buf;
+    }
+    return id >= 0 && id <= GEOIP_CORPORATE_SPEED ? netspeed_names[id] : NULL;
+}
+
+static Field netspeed_fields[] = {
+    { "netspeed", 3, 0, netspeed_field_access, netspeed_field_text },
+    { "netspeed_id", 3, 1, netspeed_field_access, netspeed_field_text },
+    { NULL },
+};
+
+static int netspeed_tostring(lua_State *L, Result *r)
+{
+    int id = (int) (intptr_t) r->data;
+    lua_pushstring(L, id >= 0 && id <= GEOIP_CORPORATE_SPEED
+	? netspeed_names[id] : "Unknown");
+    return 1;
+}
+
+
 /* --------------------------------------- */
 
 ResultMeta
-    result_meta_city = { city_fields, city_gc, city_tostring },
-    result_meta_country = { country_fields, country_gc, country_tostring },
-    result_meta_region = { region_fields, region_gc, region_tostring };
+    result_meta_city = { city_fields, 0, city_gc, city_tostring, city_pack },
+    result_meta_country = { country_fields, 0, country_gc, country_tostring },
+    result_meta_region = { region_fields, 0, region_gc, region_tostring,
+	region_pack },
+    result_meta_org = { org_fields, 0, org_gc, org_tostring },
+    result_meta_asnum = { asnum_fields, 0, org_gc, org_tostring },
+    result_meta_netspeed = { netspeed_fields, 0, country_gc,
+	netspeed_tostring };
+
+static ResultMeta *result_metas[] = {
+    &result_meta_city,
+    &result_meta_country,
+    &result_meta_region,
+    &result_meta_org,
+    &result_meta_asnum,
+    &result_meta_netspeed,
+    NULL
+};
+
+/**
+ * Build the table used to find the fields of one result type by name.  It
+ * maps each field name to its Field (as light userdata) and back, and is
+ * stored in the environment of this module with the ResultMeta as key, so
+ * that neither field access nor iteration has to compare strings.
+ */
+static void _register_fields(lua_State *L, ResultMeta *meta)
+{
+    Field *f;
+    int n;
+
+    for (n=0, f=meta->fields; f->name; f++)
+	n++;
+    meta->n_fields = n;
+
+    lua_pushlightuserdata(L, meta);
+    lua_createtable(L, 0, n * 2);
+    for (f=meta->fields; f->name; f++) {
+	lua_pushstring(L, f->name);
+	lua_pushlightuserdata(L, f);
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -5);	/* name -> field */
+	lua_insert(L, -2);
+	lua_rawset(L, -3);	/* field -> name */
+    }
+    lua_rawset(L, LUA_ENVIRONINDEX);
+}
+
+
+/**
+ * Push the field table of the result type of r (see _register_fields).
+ */
+static void _push_fields(lua_State *L, Result *r)
+{
+    lua_pushlightuserdata(L, r->meta);
+    lua_rawget(L, LUA_ENVIRONINDEX);
+}
+
 
 /**
  * Handle accesses to fields.
@@ -214,14 +639,15 @@ ResultMeta
 static int l_result_index(lua_State *L)
 {
     Result *r = (Result*) luaL_checkudata(L, 1, RESULT);
-    const char *name = luaL_checkstring(L, 2);
-
     Field *f;
-    for (f=r->meta->fields; f->name; f++)
-	if (!strcmp(f->name, name))
-	    return _access_field(L, r, f);
-    
-    return 0;
+
+    _push_fields(L, r);
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    f = (Field*) lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    return f ? _access_field(L, r, f) : 0;
 }
 
 
@@ -239,6 +665,7 @@ static int l_result_gc(lua_State *L)
 {
     Result *r = (Result*) luaL_checkudata(L, 1, RESULT);
     r->meta->gc(L, r);
+    __sync_fetch_and_add(&results_freed, 1);
     return 0;
 }
 
@@ -258,18 +685,25 @@ static int l_result_call(lua_State *L)
 
     /* if not the first call, find the last accessed field, then advance to the
      * next field. */
+    _push_fields(L, r);
     if (lua_type(L, 3) == LUA_TSTRING) {
-	const char *name = lua_tostring(L, 3);
-	while (f->name && strcmp(f->name, name))
-	    f ++;
-	if (f->name)
+	lua_pushvalue(L, 3);
+	lua_rawget(L, -2);
+	f = (Field*) lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (!f)
+	    f = r->meta->fields + r->meta->n_fields;
+	else
 	    f++;
     }
 
     if (!f->name)
 	return 0;
 
-    lua_pushstring(L, f->name);
+    /* the interned name from the field table */
+    lua_pushlightuserdata(L, f);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
     return 1 + _access_field(L, r, f);
 }
 
@@ -284,234 +718,4205 @@ static const luaL_Reg result_methods[] = {
 
 /* ----------------- GeoIP ---------------- */ 
 
+/**
+ * The lookup cache of a GeoIP object remembers the results of the most
+ * recently used IPv4 addresses, including failed lookups.  The C part here
+ * finds the slot of an address (hash chains) and keeps the slots in least
+ * recently used order; the results themselves are stored in the environment
+ * table of the GeoIP object at index slot+1, so that a hit returns the very
+ * same Result object again, and the garbage collector takes care of results
+ * that are still in use after they have been evicted.
+ */
 typedef struct {
-    GeoIP *gi;
-} lua_geoip;
+    unsigned long ipnum;
+    int prev, next;	/* LRU list; head is the most recently used */
+    int hnext;		/* next slot in the same hash chain */
+} CacheEntry;
 
+typedef struct {
+    int size;		/* number of slots */
+    int used;		/* number of slots in use */
+    int head, tail;	/* of the LRU list */
+    unsigned int mask;	/* number of buckets - 1 */
+    int shift;		/* 32 - log2 of the number of buckets */
+    unsigned long hits, misses;
+    int *buckets;	/* first slot of each hash chain, or -1 */
+    CacheEntry entries[1];	/* actually size entries */
+} Cache;
+
+#define STATS_BUCKETS 32
 
 /**
- * Look up a host name or an IP address.  The API functions _by_addr seem
- * to be superfluous, as _by_name works just as well with IP addresses.
- *
- * @param gi  GeoIP object
- * @param name  Host name or IP address to look up
- * @return  On success, a Result object is returned, else nil.
+ * Counters of the queries of one GeoIP object, see l_geoip_stats.  If
+ * sample is set, every sample-th query is timed; the histogram counts the
+ * timed queries by the power of two of their time in nanoseconds.
  */
-static int l_geoip_lookup(lua_State *L)
-{
-    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
-    Result gir, *p;
-    const char *hostname = luaL_checkstring(L, 2);
-
-    memset(&gir, 0, sizeof(gir));
+typedef struct {
+    unsigned long lookups;	/* queries of libGeoIP */
+    unsigned long misses;	/* of them, nothing found */
+    unsigned long resolves;	/* of them, by host name */
+    unsigned int sample;	/* time every sample-th query; 0 for none */
+    unsigned int countdown;	/* queries until the next timed one */
+    unsigned long timed;	/* number of timed queries */
+    unsigned long long sampled_ns;	/* total time of the timed queries */
+    unsigned long histogram[STATS_BUCKETS];
+} Stats;
 
-    switch (lgi->gi->databaseType) {
-	case GEOIP_COUNTRY_EDITION: {
-	int id = GeoIP_id_by_name(lgi->gi, hostname);
-	if (!id)
-	    return 0;
-	gir.meta = &result_meta_country;
-	gir.data = (void*) id;
-	break;
-	}
+/* clear the counters, but keep the sampling interval */
+static void _stats_reset(Stats *st)
+{
+    unsigned int sample = st->sample, countdown = st->countdown;
 
-	case GEOIP_REGION_EDITION_REV1: {
-	GeoIPRegion *reg = GeoIP_region_by_name(lgi->gi, hostname);
-	if (!reg)
-	    return 0;
-	gir.meta = &result_meta_region;
-	gir.data = (void*) reg;
-	break;
-	}
+    memset(st, 0, sizeof(*st));
+    st->sample = sample;
+    st->countdown = countdown;
+}
 
+static void _stats_add(Stats *dst, const Stats *src)
+{
+    int i;
 
-	case GEOIP_CITY_EDITION_REV1: {
-	GeoIPRecord *r = GeoIP_record_by_name(lgi->gi, hostname);
-	if (!r)
-	    return 0;
-	gir.meta = &result_meta_city;
-	gir.data = (void*) r;
-	break;
-	}
+    dst->lookups += src->lookups;
+    dst->misses += src->misses;
+    dst->resolves += src->resolves;
+    dst->timed += src->timed;
+    dst->sampled_ns += src->sampled_ns;
+    for (i=0; i<STATS_BUCKETS; i++)
+	dst->histogram[i] += src->histogram[i];
+}
 
-	default:
-	return 0;
-    }
+static void _stats_time(Stats *st, unsigned long long ns)
+{
+    int bucket = 0;
 
-    /* success - create the Result object. */
-    p = (Result*) lua_newuserdata(L, sizeof(*p));
-    memcpy(p, &gir, sizeof(*p));
-    if (luaL_newmetatable(L, RESULT))
-	luaL_register(L, NULL, result_methods);
-    lua_setmetatable(L, -2);
-    return 1;
+    while (bucket < STATS_BUCKETS - 1 && (ns >> (bucket + 1)))
+	bucket++;
+    st->timed++;
+    st->sampled_ns += ns;
+    st->histogram[bucket]++;
 }
 
 
 /**
- * Returns the database type in use.
+ * The flat index of a country database is a sorted array of the address
+ * ranges with their country ids, built by walking the binary tree of the
+ * database once.  The first range for each /16 network is kept in a second
+ * table, so that a lookup is a short binary search in a few cache lines
+ * instead of up to 32 dependent reads from the tree.
  */
-static int l_geoip_tostring(lua_State *L)
+typedef struct {
+    unsigned int n;		/* number of ranges */
+    unsigned int *starts;	/* first address of each range, ascending */
+    unsigned char *ids;		/* country id of each range */
+    unsigned int *index;	/* 65537 entries: range containing k << 16 */
+    void *map;			/* the mapped image, if loaded from one */
+    size_t map_size;
+} FlatIndex;
+
+struct reload_t;
+
+typedef struct {
+    GeoIP *gi;
+    Cache *cache;	/* NULL unless enabled with cache_entries */
+    FlatIndex *flat;	/* NULL unless the database has been compiled */
+    char *path;		/* of the database file, for reload */
+    int flags;		/* given to GeoIP_open */
+    time_t mtime;	/* of the file when last seen */
+    unsigned long reloads;	/* by calling reload */
+    unsigned long check_reloads;	/* by libGeoIP with GEOIP_CHECK_CACHE */
+    struct reload_t *reloading;	/* started by reload_async */
+    Stats stats;
+} lua_geoip;
+
+
+static void cache_clear(Cache *c)
 {
-    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
-    lua_pushstring(L, GeoIPDBDescription[(int)lgi->gi->databaseType]);
-    return 1;
-}
+    unsigned int i;
 
+    c->used = 0;
+    c->head = c->tail = -1;
+    for (i=0; i<=c->mask; i++)
+	c->buckets[i] = -1;
+}
 
-/**
- * Clean up after using a GeoIP database.  Even after this, existing
- * results seem to continue to work.
- */
-static int l_geoip_gc(lua_State *L)
+static Cache *cache_new(int size)
 {
-    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
-    if (lgi->gi) {
-	GeoIP_delete(lgi->gi);
-	lgi->gi = NULL;
+    Cache *c;
+    unsigned int n_buckets = 2;
+    int shift = 31;
+
+    /* at least two buckets, so the shift of the hash is below 32 */
+    while (n_buckets < (unsigned int) size) {
+	n_buckets <<= 1;
+	shift--;
     }
-    return 0;
-}
 
-static const luaL_Reg geoip_methods[] = {
-    { "__tostring", l_geoip_tostring },
-    { "__gc", l_geoip_gc },
-    { "lookup", l_geoip_lookup },
-    { NULL, NULL }
-};
+    c = (Cache*) malloc(sizeof(*c) + (size - 1) * sizeof(CacheEntry));
+    if (!c)
+	return NULL;
+    if (!(c->buckets = (int*) malloc(n_buckets * sizeof(int)))) {
+	free(c);
+	return NULL;
+    }
 
+    c->size = size;
+    c->mask = n_buckets - 1;
+    c->shift = shift;
+    c->hits = c->misses = 0;
+    cache_clear(c);
+    return c;
+}
+
+static void cache_free(Cache *c)
+{
+    free(c->buckets);
+    free(c);
+}
+
+/* the high bits of the product depend on all bits of the address */
+static unsigned int _cache_hash(Cache *c, unsigned long ipnum)
+{
+    return ((unsigned int) ipnum * 2654435761u) >> c->shift;
+}
+
+static void _cache_unlink(Cache *c, int slot)
+{
+    CacheEntry *e = &c->entries[slot];
+
+    if (e->prev >= 0)
+	c->entries[e->prev].next = e->next;
+    else
+	c->head = e->next;
+    if (e->next >= 0)
+	c->entries[e->next].prev = e->prev;
+    else
+	c->tail = e->prev;
+}
+
+static void _cache_link_head(Cache *c, int slot)
+{
+    CacheEntry *e = &c->entries[slot];
+
+    e->prev = -1;
+    e->next = c->head;
+    if (c->head >= 0)
+	c->entries[c->head].prev = slot;
+    c->head = slot;
+    if (c->tail < 0)
+	c->tail = slot;
+}
+
+/**
+ * Find the slot of an address and mark it as most recently used.
+ *
+ * @return  The slot, or -1 if the address is not cached.
+ */
+static int cache_find(Cache *c, unsigned long ipnum)
+{
+    int slot = c->buckets[_cache_hash(c, ipnum)];
+
+    while (slot >= 0 && c->entries[slot].ipnum != ipnum)
+	slot = c->entries[slot].hnext;
+
+    if (slot >= 0 && slot != c->head) {
+	_cache_unlink(c, slot);
+	_cache_link_head(c, slot);
+    }
+    return slot;
+}
+
+/**
+ * Get a slot for a new address, evicting the least recently used one if the
+ * cache is full.  The caller has to store the result in the slot.
+ *
+ * @return  The slot; *evicted is set to 1 if a previous entry was dropped.
+ */
+static int cache_insert(Cache *c, unsigned long ipnum, int *evicted)
+{
+    int slot, *p;
+    CacheEntry *e;
+
+    if (c->used < c->size) {
+	slot = c->used++;
+	*evicted = 0;
+    } else {
+	slot = c->tail;
+	_cache_unlink(c, slot);
+	for (p=&c->buckets[_cache_hash(c, c->entries[slot].ipnum)]; *p != slot;
+	    p=&c->entries[*p].hnext)
+	    ;
+	*p = c->entries[slot].hnext;
+	*evicted = 1;
+    }
+
+    e = &c->entries[slot];
+    e->ipnum = ipnum;
+    e->hnext = c->buckets[_cache_hash(c, ipnum)];
+    c->buckets[_cache_hash(c, ipnum)] = slot;
+    _cache_link_head(c, slot);
+    return slot;
+}
+
+
+/**
+ * Return the result type for the database in use, or NULL if this kind of
+ * database is not supported.
+ */
+static ResultMeta *_result_meta(lua_geoip *lgi)
+{
+    switch (lgi->gi->databaseType) {
+	case GEOIP_COUNTRY_EDITION:
+	case GEOIP_COUNTRY_EDITION_V6:
+	return &result_meta_country;
+
+	case GEOIP_REGION_EDITION_REV0:
+	case GEOIP_REGION_EDITION_REV1:
+	return &result_meta_region;
+
+	case GEOIP_CITY_EDITION_REV0:
+	case GEOIP_CITY_EDITION_REV1:
+	case GEOIP_CITY_EDITION_REV1_V6:
+	return &result_meta_city;
+
+	case GEOIP_ORG_EDITION:
+	case GEOIP_ISP_EDITION:
+	return &result_meta_org;
+
+	case GEOIP_ASNUM_EDITION:
+	return &result_meta_asnum;
+
+	case GEOIP_NETSPEED_EDITION:
+	return &result_meta_netspeed;
+    }
+
+    return NULL;
+}
+
+
+/* ---------- flat index ---------- */
+
+static void flat_free(FlatIndex *fi)
+{
+    if (fi->map)
+	munmap(fi->map, fi->map_size);
+    else {
+	free(fi->starts);
+	free(fi->ids);
+	free(fi->index);
+    }
+    free(fi);
+}
+
+/**
+ * State while walking the tree of a country database.
+ */
+typedef struct {
+    GeoIP *gi;
+    FlatIndex *fi;
+    unsigned int size;		/* allocated length of the arrays */
+} FlatWalk;
+
+/* read the two records of one node of the tree */
+static int _flat_read_node(GeoIP *gi, unsigned int node, unsigned int rec[2])
+{
+    unsigned char buf[6];
+    const unsigned char *p;
+    off_t offset = (off_t) node * 6;
+
+    if (gi->cache)
+	p = gi->cache + offset;
+    else if (gi->index_cache)
+	p = gi->index_cache + offset;
+    else if (pread(fileno(gi->GeoIPDatabase), buf, 6, offset) == 6)
+	p = buf;
+    else
+	return 0;
+
+    rec[0] = p[0] | (p[1] << 8) | (p[2] << 16);
+    rec[1] = p[3] | (p[4] << 8) | (p[5] << 16);
+    return 1;
+}
+
+/* append a range, or extend the last one if it has the same id */
+static int _flat_add(FlatWalk *w, unsigned int start, int id)
+{
+    FlatIndex *fi = w->fi;
+
+    if (fi->n && fi->ids[fi->n - 1] == id)
+	return 1;
+
+    if (fi->n == w->size) {
+	unsigned int *starts;
+	unsigned char *ids;
+	w->size = w->size ? w->size * 2 : 4096;
+	if (!(starts = realloc(fi->starts, w->size * sizeof(*starts))))
+	    return 0;
+	fi->starts = starts;
+	if (!(ids = realloc(fi->ids, w->size * sizeof(*ids))))
+	    return 0;
+	fi->ids = ids;
+    }
+
+    fi->starts[fi->n] = start;
+    fi->ids[fi->n] = id;
+    fi->n++;
+    return 1;
+}
+
+/* visit both subtrees of a node at the given depth, in address order */
+static int _flat_walk(FlatWalk *w, unsigned int node, int depth,
+    unsigned int prefix)
+{
+    unsigned int rec[2], start, seg = w->gi->databaseSegments[0];
+    int bit;
+
+    if (!_flat_read_node(w->gi, node, rec))
+	return 0;
+
+    for (bit=0; bit<2; bit++) {
+	start = prefix | ((unsigned int) bit << (31 - depth));
+	if (rec[bit] >= seg) {
+	    if (!_flat_add(w, start, rec[bit] - seg))
+		return 0;
+	} else if (depth == 31 || !_flat_walk(w, rec[bit], depth + 1, start))
+	    return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Build the flat index of a country database.
+ *
+ * @return  The new index, or NULL if the database can't be read or is not
+ *  an IPv4 country database.
+ */
+static FlatIndex *flat_build(GeoIP *gi)
+{
+    FlatWalk w;
+    unsigned int k, j;
+
+    if (gi->databaseType != GEOIP_COUNTRY_EDITION || gi->record_length != 3)
+	return NULL;
+
+    if (!(w.fi = (FlatIndex*) calloc(1, sizeof(FlatIndex))))
+	return NULL;
+    w.gi = gi;
+    w.size = 0;
+    if (!(w.fi->index = (unsigned int*) malloc(65537 * sizeof(int)))
+	|| !_flat_walk(&w, 0, 0, 0)) {
+	flat_free(w.fi);
+	return NULL;
+    }
+
+    for (k=0, j=0; k<65536; k++) {
+	while (j + 1 < w.fi->n && w.fi->starts[j + 1] <= k << 16)
+	    j++;
+	w.fi->index[k] = j;
+    }
+    w.fi->index[65536] = w.fi->n - 1;
+    return w.fi;
+}
+
+/**
+ * Find the range that contains an address: the last one with a start that
+ * is not above it.  The binary search has no unpredictable branches.
+ *
+ * @return  The index of the range.
+ */
+static unsigned int flat_find(FlatIndex *fi, unsigned long ipnum)
+{
+    unsigned int base = fi->index[ipnum >> 16],
+	len = fi->index[(ipnum >> 16) + 1] - base + 1, half;
+    const unsigned int *starts = fi->starts;
+
+    while (len > 1) {
+	half = len / 2;
+	base = starts[base + half] <= ipnum ? base + half : base;
+	len -= half;
+    }
+    return base;
+}
+
+/**
+ * Find the record of an IPv4 address in a database with 3 byte records by
+ * walking the tree like libGeoIP does.  The netmask is returned, not stored
+ * in the GeoIP struct, which may be shared by other threads.
+ *
+ * @return  The record minus the first segment (e.g. the country id), or -1
+ *  if the database can't be read.
+ */
+static int _seek_ipv4(GeoIP *gi, unsigned long ipnum, int *netmask)
+{
+    unsigned int rec[2], node = 0, seg = gi->databaseSegments[0];
+    int depth;
+
+    for (depth=31; depth>=0; depth--) {
+	if (!_flat_read_node(gi, node, rec))
+	    return -1;
+	node = rec[(ipnum >> depth) & 1];
+	if (node >= seg) {
+	    *netmask = 32 - depth;
+	    return node - seg;
+	}
+    }
+    return -1;
+}
+
+
+/* ---------- images of the flat index ---------- */
+
+/*
+ * An image is a file with the flat index of a country database, which is
+ * mapped into memory as it is.  It starts with this header, followed by the
+ * index (65537 entries), the starts and the ids of the ranges.  The numbers
+ * are in the byte order of the machine that wrote it.
+ */
+
+#define IMAGE_MAGIC "GeoIPimg"
+#define IMAGE_VERSION 2
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int byte_order;	/* 0x01020304 */
+    unsigned int database_type;
+    unsigned int n;		/* number of ranges */
+    unsigned int data_sum;	/* checksum of everything after the header */
+    unsigned int header_sum;	/* checksum of the header up to here */
+} ImageHeader;
+
+/* FNV-1a */
+static unsigned int _checksum(const void *p, size_t len, unsigned int h)
+{
+    const unsigned char *c = (const unsigned char*) p;
+
+    while (len--)
+	h = (h ^ *c++) * 16777619u;
+    return h;
+}
+
+static size_t _image_size(unsigned int n)
+{
+    return sizeof(ImageHeader) + 65537 * sizeof(int) + n * sizeof(int) + n;
+}
+
+/* checksum of the data after the header */
+static unsigned int _image_sum(FlatIndex *fi)
+{
+    unsigned int sum = _checksum(fi->index, 65537 * sizeof(int),
+	2166136261u);
+
+    sum = _checksum(fi->starts, fi->n * sizeof(int), sum);
+    return _checksum(fi->ids, fi->n, sum);
+}
+
+/**
+ * Write the flat index to an image file.  It is written to a new temporary
+ * file first, which then replaces the file, so that processes that have
+ * mapped the old one are not disturbed, and concurrent writers don't mix
+ * their data.
+ *
+ * @return  0 on success, else -1 with errno set.
+ */
+static int image_write(FlatIndex *fi, int type, const char *path)
+{
+    ImageHeader h;
+    char *tmp;
+    FILE *f;
+    int fd, ok;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.byte_order = 0x01020304;
+    h.database_type = type;
+    h.n = fi->n;
+    h.data_sum = _image_sum(fi);
+    h.header_sum = _checksum(&h, offsetof(ImageHeader, header_sum),
+	2166136261u);
+
+    if (!(tmp = (char*) malloc(strlen(path) + 8)))
+	return -1;
+    sprintf(tmp, "%s.XXXXXX", path);
+    if ((fd = mkstemp(tmp)) < 0) {
+	free(tmp);
+	return -1;
+    }
+    /* mkstemp creates it for the owner only, but images are shared */
+    if (fchmod(fd, 0644) || !(f = fdopen(fd, "wb"))) {
+	close(fd);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+    }
+    ok = fwrite(&h, sizeof(h), 1, f) == 1
+	&& fwrite(fi->index, sizeof(int), 65537, f) == 65537
+	&& fwrite(fi->starts, sizeof(int), fi->n, f) == fi->n
+	&& fwrite(fi->ids, 1, fi->n, f) == fi->n;
+    if (fclose(f))
+	ok = 0;
+    if (ok && rename(tmp, path))
+	ok = 0;
+    if (!ok)
+	unlink(tmp);
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Check that the index of an image leads flat_find to existing ranges only:
+ * it must not decrease, and its last entry is the last range.  This reads
+ * only the index, not the ranges.
+ *
+ * @return  1 if the index is usable.
+ */
+static int _image_index_ok(const FlatIndex *fi)
+{
+    unsigned int k;
+
+    if (!fi->n || fi->index[65536] != fi->n - 1)
+	return 0;
+    for (k=1; k<65537; k++)
+	if (fi->index[k] < fi->index[k - 1])
+	    return 0;
+    return 1;
+}
+
+/**
+ * Map an image file.  Only the header and the index are checked, so that
+ * opening doesn't read the whole file; image_verify checks the data.  On
+ * errors, a message is pushed.
+ *
+ * @param mtime  Set to the modification time of the file
+ * @return  The flat index with the mapping, or NULL.
+ */
+static FlatIndex *image_map(lua_State *L, const char *path, time_t *mtime)
+{
+    const ImageHeader *h;
+    FlatIndex *fi;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st)) {
+	lua_pushfstring(L, "cannot open %s: %s", path, strerror(errno));
+	if (fd >= 0)
+	    close(fd);
+	return NULL;
+    }
+    map = st.st_size >= sizeof(*h) ? mmap(NULL, st.st_size, PROT_READ,
+	MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+	lua_pushfstring(L, "cannot map %s: %s", path, st.st_size < sizeof(*h)
+	    ? "file too short" : strerror(errno));
+	return NULL;
+    }
+
+    h = (const ImageHeader*) map;
+    if (memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic))
+	|| h->header_sum != _checksum(h, offsetof(ImageHeader, header_sum),
+	    2166136261u)
+	|| h->version != IMAGE_VERSION || h->byte_order != 0x01020304
+	|| h->database_type != GEOIP_COUNTRY_EDITION
+	|| st.st_size != _image_size(h->n)) {
+	munmap(map, st.st_size);
+	lua_pushfstring(L, "%s is not a valid image for this version", path);
+	return NULL;
+    }
+    if (!(fi = (FlatIndex*) malloc(sizeof(*fi)))) {
+	munmap(map, st.st_size);
+	lua_pushfstring(L, "out of memory for %s", path);
+	return NULL;
+    }
+
+    fi->n = h->n;
+    fi->index = (unsigned int*) (h + 1);
+    fi->starts = fi->index + 65537;
+    fi->ids = (unsigned char*) (fi->starts + fi->n);
+    fi->map = map;
+    fi->map_size = st.st_size;
+    if (!_image_index_ok(fi)) {
+	flat_free(fi);
+	lua_pushfstring(L, "%s is corrupt", path);
+	return NULL;
+    }
+    *mtime = st.st_mtime;
+    return fi;
+}
+
+/**
+ * Check the data of a mapped image against its checksum; the index has
+ * been checked by image_map.  This reads the whole file.
+ *
+ * @return  1 if the image is intact.
+ */
+static int image_verify(FlatIndex *fi)
+{
+    return _image_sum(fi) == ((const ImageHeader*) fi->map)->data_sum;
+}
+
+/**
+ * Create the stand-in for the GeoIP struct of a database opened from an
+ * image.  It is never given to libGeoIP.
+ */
+static GeoIP *image_stub(time_t mtime)
+{
+    GeoIP *gi;
+
+    if ((gi = (GeoIP*) calloc(1, sizeof(*gi)))) {
+	gi->databaseType = GEOIP_COUNTRY_EDITION;
+	gi->record_length = 3;
+	gi->mtime = mtime;
+    }
+    return gi;
+}
+
+/* whether the object was opened by open_image */
+static int _is_image(lua_geoip *lgi)
+{
+    return lgi->flat && lgi->flat->map;
+}
+
+
+/* the first and last address of the network of ipnum */
+static void _netmask_range(unsigned long ipnum, int netmask,
+    unsigned long *first, unsigned long *last)
+{
+    unsigned long mask = netmask > 0
+	? (0xffffffffUL << (32 - netmask)) & 0xffffffffUL : 0;
+
+    *first = ipnum & mask;
+    *last = *first | (~mask & 0xffffffffUL);
+}
+
+/**
+ * Find the id of an IPv4 address in a country or netspeed database, and
+ * the range of addresses with the same id.  The flat index is used if it
+ * has been built.
+ *
+ * @return  The id, or -1 if the database can't be read.
+ */
+static int _id_range(lua_geoip *lgi, unsigned long ipnum,
+    unsigned long *first, unsigned long *last)
+{
+    FlatIndex *fi = lgi->flat;
+    unsigned int j;
+    int id, netmask;
+
+    lgi->stats.lookups++;
+    if (fi) {
+	j = flat_find(fi, ipnum);
+	id = fi->ids[j];
+	*first = fi->starts[j];
+	*last = j + 1 < fi->n ? fi->starts[j + 1] - 1 : 0xffffffffUL;
+    } else {
+	if (lgi->gi->record_length != 3
+	    || (id = _seek_ipv4(lgi->gi, ipnum, &netmask)) < 0)
+	    return -1;
+	_netmask_range(ipnum, netmask, first, last);
+    }
+
+    if (!id && lgi->gi->databaseType == GEOIP_COUNTRY_EDITION)
+	lgi->stats.misses++;
+    return id;
+}
+
+
+/**
+ * Whether the database in use is keyed by IPv6 addresses.
+ */
+static int _is_v6(lua_geoip *lgi)
+{
+    return lgi->gi->databaseType == GEOIP_COUNTRY_EDITION_V6
+	|| lgi->gi->databaseType == GEOIP_CITY_EDITION_REV1_V6;
+}
+
+
+/**
+ * Parse a dotted quad IPv4 address into a host order number.  This never
+ * allocates memory or touches the resolver.
+ *
+ * @return  1 on success, 0 if the string is not a valid address.
+ */
+static int _parse_ipv4(const char *s, unsigned long *ipnum)
+{
+    unsigned long num = 0, octet;
+    int i, digits;
+
+    for (i=0; i<4; i++) {
+	if (i && *s++ != '.')
+	    return 0;
+	for (octet=0, digits=0; *s >= '0' && *s <= '9'; s++, digits++)
+	    octet = octet * 10 + (*s - '0');
+	if (!digits || digits > 3 || octet > 255)
+	    return 0;
+	num = (num << 8) | octet;
+    }
+
+    if (*s)
+	return 0;
+    *ipnum = num;
+    return 1;
+}
+
+
+/**
+ * A numeric IPv4 or IPv6 address, as parsed by _parse_addr.
+ */
+typedef struct {
+    int v6;		/* which of the two is set */
+    unsigned long ipnum;
+    geoipv6_t ip6;
+} Addr;
+
+
+/**
+ * Parse an IPv4 (dotted quad) or IPv6 address without allocating memory or
+ * touching the resolver.
+ *
+ * @return  1 on success, 0 if the string is not a valid address.
+ */
+static int _parse_addr(const char *s, Addr *a)
+{
+    if (_parse_ipv4(s, &a->ipnum)) {
+	a->v6 = 0;
+	return 1;
+    }
+
+    if (strchr(s, ':') && inet_pton(AF_INET6, s, &a->ip6) == 1) {
+	a->v6 = 1;
+	return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * IPv6 databases store IPv4 addresses as ::a.b.c.d; IPv4 clients of a
+ * dual stack socket show up as ::ffff:a.b.c.d.
+ */
+static void _ipv4_to_ipv6(unsigned long ipnum, geoipv6_t *ip6)
+{
+    memset(ip6, 0, sizeof(*ip6));
+    ip6->s6_addr[12] = (ipnum >> 24) & 0xff;
+    ip6->s6_addr[13] = (ipnum >> 16) & 0xff;
+    ip6->s6_addr[14] = (ipnum >> 8) & 0xff;
+    ip6->s6_addr[15] = ipnum & 0xff;
+}
+
+static int _ipv6_to_ipv4(geoipv6_t *ip6, unsigned long *ipnum)
+{
+    static const unsigned char mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0xff, 0xff };
+    const unsigned char *b = ip6->s6_addr;
+
+    if (memcmp(b, mapped, sizeof(mapped)))
+	return 0;
+    *ipnum = ((unsigned long) b[12] << 24) | (b[13] << 16) | (b[14] << 8)
+	| b[15];
+    return 1;
+}
+
+
+static int _resolve_ipv4(const char *name, unsigned long *ipnum);
+
+/**
+ * Query the database and fill in the Result structure.  The address is
+ * given either as host name, or as IPv6 address (only for IPv6 databases),
+ * or else as ipnum; the _by_name functions are only used for host names.
+ *
+ * @return  1 on success, 0 if nothing was found.
+ */
+static int _query_db(lua_geoip *lgi, const char *name, geoipv6_t *ip6,
+    unsigned long ipnum, Result *gir)
+{
+    GeoIP *gi = lgi->gi;
+
+    switch (gi->databaseType) {
+	case GEOIP_COUNTRY_EDITION: {
+	int id;
+	/* an image has no database file for libGeoIP to look up names */
+	if (name && _is_image(lgi)) {
+	    if (!_resolve_ipv4(name, &ipnum))
+		return 0;
+	    name = NULL;
+	}
+	id = name ? GeoIP_id_by_name(gi, name)
+	    : lgi->flat ? lgi->flat->ids[flat_find(lgi->flat, ipnum)]
+	    : GeoIP_id_by_ipnum(gi, ipnum);
+	if (!id)
+	    return 0;
+	gir->meta = &result_meta_country;
+	gir->data = (void*) (intptr_t) id;
+	return 1;
+	}
+
+	case GEOIP_COUNTRY_EDITION_V6: {
+	int id = name ? GeoIP_id_by_name_v6(gi, name)
+	    : GeoIP_id_by_ipnum_v6(gi, *ip6);
+	if (!id)
+	    return 0;
+	gir->meta = &result_meta_country;
+	gir->data = (void*) (intptr_t) id;
+	return 1;
+	}
+
+	case GEOIP_NETSPEED_EDITION: {
+	/* 0 is a valid value here (unknown speed) */
+	int id = name ? GeoIP_id_by_name(gi, name) : GeoIP_id_by_ipnum(gi, ipnum);
+	gir->meta = &result_meta_netspeed;
+	gir->data = (void*) (intptr_t) id;
+	return 1;
+	}
+
+	case GEOIP_REGION_EDITION_REV0:
+	case GEOIP_REGION_EDITION_REV1: {
+	GeoIPRegion *reg = name ? GeoIP_region_by_name(gi, name)
+	    : GeoIP_region_by_ipnum(gi, ipnum);
+	if (!reg)
+	    return 0;
+	gir->meta = &result_meta_region;
+	gir->data = (void*) reg;
+	return 1;
+	}
+
+	case GEOIP_CITY_EDITION_REV0:
+	case GEOIP_CITY_EDITION_REV1: {
+	GeoIPRecord *r = name ? GeoIP_record_by_name(gi, name)
+	    : GeoIP_record_by_ipnum(gi, ipnum);
+	if (!r)
+	    return 0;
+	gir->meta = &result_meta_city;
+	gir->data = (void*) r;
+	return 1;
+	}
+
+	case GEOIP_CITY_EDITION_REV1_V6: {
+	GeoIPRecord *r = name ? GeoIP_record_by_name_v6(gi, name)
+	    : GeoIP_record_by_ipnum_v6(gi, *ip6);
+	if (!r)
+	    return 0;
+	gir->meta = &result_meta_city;
+	gir->data = (void*) r;
+	return 1;
+	}
+
+	case GEOIP_ORG_EDITION:
+	case GEOIP_ISP_EDITION:
+	case GEOIP_ASNUM_EDITION: {
+	char *org = name ? GeoIP_name_by_name(gi, name)
+	    : GeoIP_name_by_ipnum(gi, ipnum);
+	if (!org)
+	    return 0;
+	gir->meta = gi->databaseType == GEOIP_ASNUM_EDITION
+	    ? &result_meta_asnum : &result_meta_org;
+	gir->data = (void*) org;
+	return 1;
+	}
+    }
+
+    return 0;
+}
+
+
+/**
+ * Query the database as _query_db does.  With GEOIP_CHECK_CACHE, libGeoIP
+ * may reload the file during a lookup; count these reloads.
+ */
+static int _query(lua_geoip *lgi, const char *name, geoipv6_t *ip6,
+    unsigned long ipnum, Result *gir)
+{
+    Stats *st = &lgi->stats;
+    struct timespec t0, t1;
+    int found, timed = st->sample && !--st->countdown;
+
+    if (timed) {
+	st->countdown = st->sample;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+    }
+    found = _query_db(lgi, name, ip6, ipnum, gir);
+    if (timed) {
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	_stats_time(st, (t1.tv_sec - t0.tv_sec) * 1000000000ULL
+	    + t1.tv_nsec - t0.tv_nsec);
+    }
+
+    st->lookups++;
+    if (!found)
+	st->misses++;
+    if (name)
+	st->resolves++;
+
+    if ((lgi->flags & GEOIP_CHECK_CACHE) && lgi->gi->mtime != lgi->mtime) {
+	lgi->mtime = lgi->gi->mtime;
+	lgi->check_reloads++;
+    }
+    return found;
+}
+
+
+/**
+ * Look up a numeric IPv6 address.  For an IPv4 database, only IPv4 mapped
+ * addresses can be found.
+ *
+ * @return  1 on success, 0 if nothing was found.
+ */
+static int _lookup_ipv6(lua_geoip *lgi, geoipv6_t *ip6, Result *gir)
+{
+    unsigned long ipnum;
+    geoipv6_t compat;
+
+    if (!_is_v6(lgi))
+	return _ipv6_to_ipv4(ip6, &ipnum) && _query(lgi, NULL, NULL, ipnum,
+	    gir);
+
+    if (_ipv6_to_ipv4(ip6, &ipnum)) {
+	_ipv4_to_ipv6(ipnum, &compat);
+	ip6 = &compat;
+    }
+    return _query(lgi, NULL, ip6, 0, gir);
+}
+
+
+/**
+ * Look up a numeric IPv4 address and fill in the Result structure.  The
+ * _by_ipnum functions go straight to the database.
+ *
+ * @return  1 on success, 0 if nothing was found.
+ */
+static int _lookup_ipnum(lua_geoip *lgi, unsigned long ipnum, Result *gir)
+{
+    geoipv6_t ip6;
+
+    if (!_is_v6(lgi))
+	return _query(lgi, NULL, NULL, ipnum, gir);
+
+    _ipv4_to_ipv6(ipnum, &ip6);
+    return _query(lgi, NULL, &ip6, 0, gir);
+}
+
+
+static int _is_shareable(int flags);
+
+/**
+ * Look up an IPv4 address like _lookup_ipnum, and find the range of
+ * addresses around it that have the same result.  The netmask that libGeoIP
+ * keeps in the GeoIP struct, and copies into city records, is only used if
+ * this object has a database of its own; with a shared one, the range is
+ * just the address itself unless the flat index gives it.
+ *
+ * @return  1 on success, 0 if nothing was found (the range is still set),
+ *  or -1 if the database can't be read.
+ */
+static int _lookup_range(lua_geoip *lgi, unsigned long ipnum, Result *gir,
+    unsigned long *first, unsigned long *last)
+{
+    GeoIP *gi = lgi->gi;
+    int id, found, netmask = 32;
+
+    switch (gi->databaseType) {
+	case GEOIP_COUNTRY_EDITION:
+	case GEOIP_NETSPEED_EDITION:
+	if ((id = _id_range(lgi, ipnum, first, last)) < 0)
+	    return -1;
+	gir->meta = gi->databaseType == GEOIP_COUNTRY_EDITION
+	    ? &result_meta_country : &result_meta_netspeed;
+	gir->data = (void*) (intptr_t) id;
+	return id || gi->databaseType == GEOIP_NETSPEED_EDITION;
+    }
+
+    /* the netmask of IPv6 databases is about IPv6 addresses */
+    found = _lookup_ipnum(lgi, ipnum, gir);
+    if (!_is_shareable(lgi->flags) && !_is_v6(lgi))
+	netmask = found && gir->meta == &result_meta_city
+	    ? ((GeoIPRecord*) gir->data)->netmask : GeoIP_last_netmask(gi);
+    _netmask_range(ipnum, netmask, first, last);
+    return found;
+}
+
+
+/**
+ * Look up a numeric address of either family.
+ */
+static int _lookup_addr(lua_geoip *lgi, Addr *a, Result *gir)
+{
+    return a->v6 ? _lookup_ipv6(lgi, &a->ip6, gir)
+	: _lookup_ipnum(lgi, a->ipnum, gir);
+}
+
+
+/**
+ * Look up a host name or an IP address and fill in the Result structure.
+ * Numeric addresses are handled without the _by_name functions, which would
+ * parse the string again and possibly ask the resolver.
+ *
+ * @return  1 on success, 0 if nothing was found.
+ */
+static int _lookup(lua_geoip *lgi, const char *hostname, Result *gir)
+{
+    Addr a;
+
+    if (_parse_addr(hostname, &a))
+	return _lookup_addr(lgi, &a, gir);
+    return _query(lgi, hostname, NULL, 0, gir);
+}
+
+
+/**
+ * Push the metatable for Result objects, creating it on first use.
+ */
+static void _push_result_metatable(lua_State *L)
+{
+    if (luaL_newmetatable(L, RESULT))
+	luaL_register(L, NULL, result_methods);
+}
+
+
+/* move src into dst, packing the record into the room bytes after dst */
+static void _pack_result(lua_State *L, Result *dst, Result *src, size_t room)
+{
+    memcpy(dst, src, sizeof(*dst));
+    if (src->meta->pack && src->meta->pack(src, NULL) <= room) {
+	src->meta->pack(src, dst + 1);
+	dst->data = dst + 1;
+	src->meta->gc(L, src);
+    }
+}
+
+
+/**
+ * Create a Result object from the filled in structure.  The metatable for
+ * results must be at the given stack index.
+ */
+static void _push_result(lua_State *L, Result *gir, int mt)
+{
+    size_t room = gir->meta->pack ? gir->meta->pack(gir, NULL) : 0;
+    Result *p = (Result*) lua_newuserdata(L, sizeof(*p) + room);
+
+    _pack_result(L, p, gir, room);
+    __sync_fetch_and_add(&results_created, 1);
+    lua_pushvalue(L, mt < 0 ? mt - 1 : mt);
+    lua_setmetatable(L, -2);
+}
+
+
+/**
+ * Push the Result for a numeric address, and use the lookup cache if the
+ * GeoIP object has one.
+ *
+ * @param index  Stack index of the GeoIP object
+ * @param mt  Stack index of the metatable for results
+ * @return  1 if a Result has been pushed, 0 if nothing was found (and
+ *  nothing pushed).
+ */
+static int _push_lookup_ipnum(lua_State *L, lua_geoip *lgi, int index,
+    unsigned long ipnum, int mt)
+{
+    Cache *c = lgi->cache;
+    int slot, evicted, found;
+    Result gir;
+
+    if (mt < 0)
+	mt = lua_gettop(L) + mt + 1;
+    memset(&gir, 0, sizeof(gir));
+
+    if (!c) {
+	if (!_lookup_ipnum(lgi, ipnum, &gir))
+	    return 0;
+	_push_result(L, &gir, mt);
+	return 1;
+    }
+
+    lua_getfenv(L, index);
+    if ((slot = cache_find(c, ipnum)) >= 0) {
+	c->hits++;
+	lua_rawgeti(L, -1, slot + 1);
+	lua_remove(L, -2);
+	if (lua_toboolean(L, -1))
+	    return 1;
+	lua_pop(L, 1);
+	return 0;
+    }
+
+    c->misses++;
+    slot = cache_insert(c, ipnum, &evicted);
+    if (evicted) {
+	/* the old result may live on, but it is no longer shared. */
+	Result *old;
+	lua_rawgeti(L, -1, slot + 1);
+	if ((old = (Result*) lua_touserdata(L, -1)))
+	    old->cached = 0;
+	lua_pop(L, 1);
+    }
+
+    if ((found = _lookup_ipnum(lgi, ipnum, &gir))) {
+	gir.cached = 1;
+	_push_result(L, &gir, mt);
+    } else
+	lua_pushboolean(L, 0);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, slot + 1);
+    lua_remove(L, -2);
+
+    if (found)
+	return 1;
+    lua_pop(L, 1);
+    return 0;
+}
+
+
+/**
+ * Push the Result for a numeric address of either family.  Only IPv4
+ * addresses go through the lookup cache.
+ */
+static int _push_lookup_addr(lua_State *L, lua_geoip *lgi, int index,
+    Addr *a, int mt)
+{
+    Result gir;
+
+    if (!a->v6)
+	return _push_lookup_ipnum(L, lgi, index, a->ipnum, mt);
+
+    memset(&gir, 0, sizeof(gir));
+    if (!_lookup_ipv6(lgi, &a->ip6, &gir))
+	return 0;
+    _push_result(L, &gir, mt);
+    return 1;
+}
+
+
+/**
+ * Push the Result for a host name or IP address.
+ *
+ * @param index  Stack index of the GeoIP object
+ * @param mt  Stack index of the metatable for results
+ * @return  1 if a Result has been pushed, 0 if nothing was found.
+ */
+static int _push_lookup(lua_State *L, lua_geoip *lgi, int index,
+    const char *hostname, int mt)
+{
+    Result gir;
+    Addr a;
+
+    if (_parse_addr(hostname, &a))
+	return _push_lookup_addr(L, lgi, index, &a, mt);
+
+    memset(&gir, 0, sizeof(gir));
+    if (!_lookup(lgi, hostname, &gir))
+	return 0;
+    _push_result(L, &gir, mt);
+    return 1;
+}
+
+
+/**
+ * Find the result for a host name or IP address in order to read its fields.
+ * With the lookup cache, the cached Result is pushed and returned; it must
+ * not be freed.  Otherwise gir is filled in and returned, and the caller
+ * has to call its gc function.  The caller restores the stack afterwards.
+ *
+ * @return  The result, or NULL if nothing was found.
+ */
+static Result *_lookup_fields(lua_State *L, lua_geoip *lgi, int index,
+    const char *hostname, Result *gir)
+{
+    unsigned long ipnum;
+
+    if (lgi->cache && _parse_ipv4(hostname, &ipnum)) {
+	_push_result_metatable(L);
+	if (!_push_lookup_ipnum(L, lgi, index, ipnum, -1))
+	    return NULL;
+	return (Result*) lua_touserdata(L, -1);
+    }
+
+    memset(gir, 0, sizeof(*gir));
+    return _lookup(lgi, hostname, gir) ? gir : NULL;
+}
+
+
+/**
+ * Look up a host name or an IP address.
+ *
+ * @param gi  GeoIP object
+ * @param name  Host name or IP address to look up
+ * @return  On success, a Result object is returned, else nil.
+ */
+static int l_geoip_lookup(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *hostname = luaL_checkstring(L, 2);
+
+    _push_result_metatable(L);
+    return _push_lookup(L, lgi, 1, hostname, -1);
+}
+
+
+/**
+ * Push a plain table with all the fields of the result.  The field names are
+ * taken from the field table, so they are not hashed again.
+ */
+static void _push_result_table(lua_State *L, Result *gir)
+{
+    Field *f;
+
+    lua_createtable(L, 0, gir->meta->n_fields);
+    _push_fields(L, gir);
+    for (f=gir->meta->fields; f->name; f++) {
+	lua_pushlightuserdata(L, f);
+	lua_rawget(L, -2);
+	if (_access_field(L, gir, f))
+	    lua_rawset(L, -4);
+	else
+	    lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+
+/**
+ * Look up a host name or an IP address like lookup does, but return all the
+ * fields at once in a table.  This is faster than a Result object when most
+ * of the fields are read anyway.
+ *
+ * @param gi  GeoIP object
+ * @param name  Host name or IP address to look up
+ * @return  On success, a table with the fields is returned, else nil.
+ */
+static int l_geoip_lookup_table(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *hostname = luaL_checkstring(L, 2);
+    Result gir, *r;
+
+    if (!(r = _lookup_fields(L, lgi, 1, hostname, &gir)))
+	return 0;
+
+    _push_result_table(L, r);
+    if (r == &gir)
+	gir.meta->gc(L, &gir);
+    return 1;
+}
+
+
+/**
+ * Look up a host name or IP address and store the result in an existing
+ * Result object, which is returned.  The data previously held by it is freed
+ * first.  A loop can reuse one Result this way instead of creating a new
+ * object for each lookup.
+ *
+ * Results returned from the lookup cache are shared and can't be reused;
+ * the lookup cache is not used here.
+ *
+ * @param gi  GeoIP object
+ * @param r  A Result object as returned by lookup
+ * @param name  Host name or IP address to look up
+ * @return  r on success; else nil, and r is left unchanged.
+ */
+static int l_geoip_lookup_into(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    Result *r = (Result*) luaL_checkudata(L, 2, RESULT);
+    const char *hostname = luaL_checkstring(L, 3);
+    Result gir;
+
+    luaL_argcheck(L, !r->cached, 2, "result is shared by the lookup cache");
+    memset(&gir, 0, sizeof(gir));
+    if (!_lookup(lgi, hostname, &gir))
+	return 0;
+
+    r->meta->gc(L, r);
+    _pack_result(L, r, &gir, lua_objlen(L, 2) - sizeof(*r));
+    lua_settop(L, 2);
+    return 1;
+}
+
+
+/**
+ * A prepared query: the fields to return, resolved once by prepare.
+ */
+typedef struct {
+    int n;
+    Field *fields[1];	/* actually n entries */
+} Query;
+
+
+/**
+ * Run a prepared query.  The GeoIP object and the Query are upvalues.
+ *
+ * @param name  Host name or IP address to look up
+ * @return  The values of the selected fields (nil for missing ones), or
+ *  nil if nothing was found.
+ */
+static int l_query_call(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) lua_touserdata(L, lua_upvalueindex(1));
+    Query *q = (Query*) lua_touserdata(L, lua_upvalueindex(2));
+    const char *hostname = luaL_checkstring(L, 1);
+    Result gir, *r;
+    int i;
+
+    if (!(r = _lookup_fields(L, lgi, lua_upvalueindex(1), hostname, &gir)))
+	return 0;
+
+    luaL_checkstack(L, q->n, "too many fields");
+    for (i=0; i<q->n; i++)
+	if (!_access_field(L, r, q->fields[i]))
+	    lua_pushnil(L);
+
+    if (r == &gir)
+	gir.meta->gc(L, &gir);
+    return q->n;
+}
+
+
+/**
+ * Prepare a query that returns only the given fields.  The field names are
+ * resolved now; the returned function then does the lookup and returns the
+ * values directly, without creating a Result object or table.
+ *
+ *  q = g:prepare{ "country_code", "city" }
+ *  cc, city = q("74.125.67.100")
+ *
+ * @param gi  GeoIP object
+ * @param fields  Array with the names of the fields
+ * @return  A function that takes a host name or IP address.
+ */
+static int l_geoip_prepare(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    ResultMeta *meta = _result_meta(lgi);
+    Result gir;
+    Query *q;
+    int i, n;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!meta)
+	return luaL_error(L, "unsupported database type");
+    n = lua_objlen(L, 2);
+    luaL_argcheck(L, n > 0, 2, "no fields given");
+
+    lua_pushvalue(L, 1);
+    q = (Query*) lua_newuserdata(L, sizeof(*q) + (n - 1) * sizeof(Field*));
+    q->n = n;
+
+    gir.meta = meta;
+    _push_fields(L, &gir);
+    for (i=0; i<n; i++) {
+	lua_rawgeti(L, 2, i + 1);
+	lua_rawget(L, -2);
+	if (!(q->fields[i] = (Field*) lua_touserdata(L, -1))) {
+	    lua_rawgeti(L, 2, i + 1);
+	    return luaL_error(L, "unknown field %s",
+		lua_tostring(L, -1));
+	}
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    lua_pushcclosure(L, l_query_call, 2);
+    return 1;
+}
+
+
+/**
+ * A compiled format: literal text and fields in the order of output.
+ */
+typedef struct {
+    Field *field;	/* NULL for literal text */
+    const char *text;
+    size_t len;
+} FormatPart;
+
+typedef struct {
+    int n;
+    FormatPart parts[1];	/* actually n entries, followed by the text */
+} Format;
+
+/* key of the table of compiled formats in the module environment */
+static char formats_key;
+
+
+/**
+ * Push the table of compiled formats for a result type.  It maps the format
+ * strings to Format objects and has weak values, so unused formats are
+ * collected again.
+ */
+static void _push_formats(lua_State *L, ResultMeta *meta)
+{
+    lua_pushlightuserdata(L, &formats_key);
+    lua_rawget(L, LUA_ENVIRONINDEX);
+    lua_pushlightuserdata(L, meta);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_pushlightuserdata(L, meta);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);
+}
+
+
+/**
+ * Compile the format string at the given stack index into a Format object,
+ * which is pushed.  A field is written as its name between percent signs,
+ * "%%" stands for a percent sign.
+ */
+static Format *_compile_format(lua_State *L, ResultMeta *meta, int index)
+{
+    size_t len, i;
+    const char *fmt = lua_tolstring(L, index, &len);
+    const char *end;
+    FormatPart *part = NULL;
+    Format *fm;
+    Result gir;
+    char *out;
+    int max = 1;
+
+    for (i=0; i<len; i++)
+	if (fmt[i] == '%')
+	    max++;
+
+    fm = (Format*) lua_newuserdata(L, sizeof(*fm)
+	+ (max - 1) * sizeof(FormatPart) + len);
+    out = (char*) (fm->parts + max);
+    fm->n = 0;
+
+    gir.meta = meta;
+    _push_fields(L, &gir);
+    for (i=0; i<len; ) {
+	if (fmt[i] == '%' && (i + 1 >= len || fmt[i + 1] != '%')) {
+	    if (!(end = memchr(fmt + i + 1, '%', len - i - 1)))
+		luaL_error(L, "unterminated field name in format");
+	    lua_pushlstring(L, fmt + i + 1, end - fmt - i - 1);
+	    lua_rawget(L, -2);
+	    part = fm->parts + fm->n++;
+	    if (!(part->field = (Field*) lua_touserdata(L, -1))) {
+		lua_pushlstring(L, fmt + i + 1, end - fmt - i - 1);
+		luaL_error(L, "unknown field %s", lua_tostring(L, -1));
+	    }
+	    lua_pop(L, 1);
+	    part = NULL;
+	    i = end - fmt + 1;
+	    continue;
+	}
+
+	/* literal text, collected in the copy after the parts */
+	if (!part) {
+	    part = fm->parts + fm->n++;
+	    part->field = NULL;
+	    part->text = out;
+	    part->len = 0;
+	}
+	*out++ = fmt[i];
+	part->len++;
+	i += fmt[i] == '%' ? 2 : 1;
+    }
+    lua_pop(L, 1);
+
+    return fm;
+}
+
+
+/**
+ * Look up a host name or IP address and fill the fields of the result into a
+ * format string, e.g. "%country_code%|%city%".  Fields that are not set are
+ * left empty.  The format is compiled on first use and then kept; the text
+ * is built in one buffer, without a Result object or strings for the fields.
+ *
+ * @param gi  GeoIP object
+ * @param name  Host name or IP address to look up
+ * @param format  The format string
+ * @return  The formatted string, or nil if nothing was found.
+ */
+static int l_geoip_format(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *hostname = luaL_checkstring(L, 2);
+    ResultMeta *meta = _result_meta(lgi);
+    char buf[TEXT_SIZE];
+    const char *s;
+    luaL_Buffer b;
+    Result gir, *r;
+    Format *fm;
+    int i;
+
+    luaL_checkstring(L, 3);
+    if (!meta)
+	return luaL_error(L, "unsupported database type");
+
+    lua_settop(L, 3);
+    _push_formats(L, meta);
+    lua_pushvalue(L, 3);
+    lua_rawget(L, 4);
+    if (!(fm = (Format*) lua_touserdata(L, -1))) {
+	lua_pop(L, 1);
+	fm = _compile_format(L, meta, 3);
+	lua_pushvalue(L, 3);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 4);
+    }
+
+    /* the Format stays on the stack, so it isn't collected meanwhile */
+    if (!(r = _lookup_fields(L, lgi, 1, hostname, &gir)))
+	return 0;
+
+    luaL_buffinit(L, &b);
+    for (i=0; i<fm->n; i++) {
+	if (!fm->parts[i].field)
+	    luaL_addlstring(&b, fm->parts[i].text, fm->parts[i].len);
+	else if ((s = _field_text(r, fm->parts[i].field, buf)))
+	    luaL_addstring(&b, s);
+    }
+    luaL_pushresult(&b);
+
+    if (r == &gir)
+	gir.meta->gc(L, &gir);
+    return 1;
+}
+
+
+/**
+ * Look up a numeric IP address given as dotted quad or in IPv6 notation.
+ * Unlike lookup, this never falls back to resolving a host name, so the time
+ * it takes is bounded.
+ *
+ * @param gi  GeoIP object
+ * @param addr  IP address like "74.125.67.100" or "2001:db8::1"
+ * @return  On success, a Result object is returned, else nil.
+ */
+static int l_geoip_lookup_addr(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *addr = luaL_checkstring(L, 2);
+    Addr a;
+
+    if (!_parse_addr(addr, &a))
+	return 0;
+
+    _push_result_metatable(L);
+    return _push_lookup_addr(L, lgi, 1, &a, -1);
+}
+
+
+/**
+ * Look up an IPv4 address given as number in host byte order, e.g.
+ * 1249592164 for 74.125.67.100.
+ *
+ * @param gi  GeoIP object
+ * @param ipnum  IPv4 address as integer
+ * @return  On success, a Result object is returned, else nil.
+ */
+static int l_geoip_lookup_ipnum(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    lua_Number n = luaL_checknumber(L, 2);
+
+    luaL_argcheck(L, n >= 0 && n <= 4294967295.0, 2, "not an IPv4 address");
+    _push_result_metatable(L);
+    return _push_lookup_ipnum(L, lgi, 1, (unsigned long) n, -1);
+}
+
+
+/* ---------- worker pool for lookup_many ---------- */
+
+#define POOL_MAX_THREADS 64
+#define POOL_CHUNK 256		/* addresses taken by a worker at once */
+#define BATCH "GeoIPBatch"
+
+/**
+ * One call of lookup_many that is spread over the worker pool.  Workers
+ * fill in results[i] for the entries with addr_ok[i] set; the Lua objects
+ * are created by the calling thread afterwards.
+ */
+typedef struct {
+    lua_geoip *lgi;
+    int n;
+    Addr *addrs;
+    char *addr_ok;	/* 1 for numeric addresses, 2 when found */
+    Result *results;
+    int next;		/* next entry to process */
+    int finished;	/* number of entries processed */
+    int slots;		/* number of workers that may still join */
+} Batch;
+
+/*
+ * The pool is shared by all Lua states of the process.  One batch runs at a
+ * time; busy serializes the calls.  The workers are stopped and joined when
+ * the last Lua state that loaded the module is closed, before Lua unloads
+ * the library, see _pool_gc.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;	/* a batch is available, or stop is set */
+    pthread_cond_t done;	/* a batch has been finished */
+    pthread_mutex_t busy;	/* held while a batch runs */
+    int n_threads;
+    Batch *batch;
+    int stop;		/* workers should exit */
+    int states;		/* number of Lua states using the module */
+    pthread_t threads[POOL_MAX_THREADS];
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+/**
+ * Process chunks of the batch until none are left.  Called with pool.lock
+ * held, which is released while looking up.
+ */
+static void _batch_run(Batch *b)
+{
+    int i, first, last;
+    lua_geoip view;
+
+    while (b->next < b->n) {
+	first = b->next;
+	last = first + POOL_CHUNK < b->n ? first + POOL_CHUNK : b->n;
+	b->next = last;
+	/* the counters are kept in a copy and added up with the lock held */
+	view = *b->lgi;
+	_stats_reset(&view.stats);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i=first; i<last; i++) {
+	    if (b->addr_ok[i]
+		&& _lookup_addr(&view, &b->addrs[i], &b->results[i]))
+		b->addr_ok[i] = 2;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	_stats_add(&b->lgi->stats, &view.stats);
+	b->finished += last - first;
+	if (b->finished == b->n)
+	    pthread_cond_signal(&pool.done);
+    }
+}
+
+static void *_pool_worker(void *arg)
+{
+    Batch *b;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+	while (!pool.stop
+	    && (!(b = pool.batch) || !b->slots || b->next >= b->n))
+	    pthread_cond_wait(&pool.work, &pool.lock);
+	if (pool.stop)
+	    break;
+	b->slots--;
+	_batch_run(b);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/**
+ * Start more workers, so that there are at least n.  They run until the
+ * module is unloaded.
+ *
+ * @return  The number of workers.
+ */
+static int _pool_grow(int n)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.n_threads < n && pool.n_threads < POOL_MAX_THREADS
+	&& !pthread_create(&pool.threads[pool.n_threads], NULL, _pool_worker,
+	NULL))
+	pool.n_threads++;
+    n = pool.n_threads;
+    pthread_mutex_unlock(&pool.lock);
+    return n;
+}
+
+/**
+ * __gc of the sentinel that each Lua state gets when loading the module.
+ * It is created after the handle of the library, so it is finalized
+ * before Lua closes the library.  When the last state goes away, the
+ * workers are stopped and joined, as their code is about to be unmapped.
+ */
+static int _pool_gc(lua_State *L)
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.states == 0) {
+	n = pool.n_threads;
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i=0; i<n; i++)
+	pthread_join(pool.threads[i], NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    if (n) {
+	pool.n_threads = 0;
+	pool.stop = 0;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+/* keep a sentinel in the registry that counts this state as a pool user */
+static void _pool_register(lua_State *L)
+{
+    lua_pushlightuserdata(L, &pool);
+    lua_newuserdata(L, 1);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, _pool_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.states++;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * Look up the numeric addresses of the batch with up to threads threads,
+ * including the calling one.
+ */
+static void _batch_lookup(Batch *b, int threads)
+{
+    int workers = _pool_grow(threads - 1);
+
+    pthread_mutex_lock(&pool.busy);
+    pthread_mutex_lock(&pool.lock);
+    b->next = b->finished = 0;
+    b->slots = workers < threads - 1 ? workers : threads - 1;
+    pool.batch = b;
+    pthread_cond_broadcast(&pool.work);
+
+    _batch_run(b);
+    while (b->finished < b->n)
+	pthread_cond_wait(&pool.done, &pool.lock);
+    pool.batch = NULL;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+}
+
+/**
+ * __gc of the userdata that holds a Batch: free the results that have not
+ * been turned into Result objects, e.g. after a memory error.
+ */
+static int _batch_gc(lua_State *L)
+{
+    Batch *b = (Batch*) lua_touserdata(L, 1);
+    int i;
+
+    for (i=0; i<b->n; i++) {
+	if (b->addr_ok[i] == 2)
+	    b->results[i].meta->gc(L, &b->results[i]);
+    }
+    return 0;
+}
+
+/**
+ * lookup_many with the threads option: the array of names is at index 2.
+ * Numeric addresses are looked up by the worker pool; host names are left
+ * for the calling thread, as the resolver may block.
+ */
+static int _lookup_many_threads(lua_State *L, lua_geoip *lgi, int n,
+    int threads)
+{
+    const char *hostname;
+    Batch *b;
+    int i;
+
+    if (!_is_shareable(lgi->flags))
+	return luaL_error(L, "lookup_many with threads needs cache mode"
+	    " memory or mmap without check");
+
+    /* the results are owned by the userdata until they are pushed */
+    b = (Batch*) lua_newuserdata(L, sizeof(*b) + n * (sizeof(Addr)
+	+ sizeof(Result) + 1) + 1);
+    b->lgi = lgi;
+    b->n = n;
+    b->addrs = (Addr*) (b + 1);
+    b->results = (Result*) (b->addrs + n);
+    b->addr_ok = (char*) (b->results + n);
+    memset(b->results, 0, n * sizeof(Result));
+    memset(b->addr_ok, 0, n);
+    if (luaL_newmetatable(L, BATCH)) {
+	lua_pushcfunction(L, _batch_gc);
+	lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    for (i=0; i<n; i++) {
+	lua_rawgeti(L, 2, i + 1);
+	if (!(hostname = lua_tostring(L, -1)))
+	    return luaL_error(L, "bad entry #%d in lookup_many (string"
+		" expected)", i + 1);
+	b->addr_ok[i] = _parse_addr(hostname, &b->addrs[i]);
+	lua_pop(L, 1);
+    }
+
+    _batch_lookup(b, threads);
+
+    lua_createtable(L, n, 0);
+    _push_result_metatable(L);
+    for (i=0; i<n; i++) {
+	if (b->addr_ok[i] == 2) {
+	    _push_result(L, &b->results[i], -1);
+	    b->addr_ok[i] = 1;		/* now owned by the Result object */
+	} else if (b->addr_ok[i] == 1)
+	    lua_pushboolean(L, 0);
+	else {
+	    lua_rawgeti(L, 2, i + 1);
+	    if (!_push_lookup(L, lgi, 1, lua_tostring(L, -1), -2))
+		lua_pushboolean(L, 0);
+	    lua_remove(L, -2);
+	}
+	lua_rawseti(L, -3, i + 1);
+    }
+
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+/**
+ * Look up an array of IP addresses that is sorted, e.g. from a flow export.
+ * The range of addresses with the same result as the last one is kept, and
+ * the following addresses within it get the same Result object without
+ * another lookup.  Such shared results can't be given to lookup_into.  The
+ * output is correct for unsorted input as well, only slower.  Entries that
+ * are not IPv4 addresses are looked up one by one like lookup does.
+ *
+ * @param gi  GeoIP object
+ * @param names  Array of IP addresses (or host names)
+ * @return  An array with one entry per name: a Result object, or false if
+ *  the lookup failed.
+ */
+static int l_geoip_lookup_sorted(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    unsigned long ipnum, first = 1, last = 0;
+    const char *hostname;
+    Result gir;
+    int i, n, found;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    n = lua_objlen(L, 2);
+    lua_createtable(L, n, 0);	/* 3 */
+    _push_result_metatable(L);	/* 4 */
+    lua_pushboolean(L, 0);	/* 5: result for first..last */
+
+    for (i=1; i<=n; i++) {
+	lua_rawgeti(L, 2, i);
+	if (!(hostname = lua_tostring(L, -1)))
+	    return luaL_error(L, "bad entry #%d in lookup_sorted (string"
+		" expected)", i);
+
+	if (!_parse_ipv4(hostname, &ipnum)) {
+	    if (!_push_lookup(L, lgi, 1, hostname, 4))
+		lua_pushboolean(L, 0);
+	} else if (ipnum >= first && ipnum <= last) {
+	    lua_pushvalue(L, 5);
+	    if (lua_isuserdata(L, -1))
+		((Result*) lua_touserdata(L, -1))->cached = 1;
+	} else {
+	    memset(&gir, 0, sizeof(gir));
+	    if ((found = _lookup_range(lgi, ipnum, &gir, &first, &last)) < 0)
+		return luaL_error(L, "can't read the database %s",
+		    lgi->path);
+	    if (found)
+		_push_result(L, &gir, 4);
+	    else
+		lua_pushboolean(L, 0);
+	    lua_pushvalue(L, -1);
+	    lua_replace(L, 5);
+	}
+
+	lua_rawseti(L, 3, i);
+	lua_pop(L, 1);
+    }
+
+    lua_settop(L, 3);
+    return 1;
+}
+
+
+/* ---------- asynchronous lookups ---------- */
+
+/* resolved names kept, and for how many seconds */
+#define RESOLVE_ENTRIES 1024
+#define RESOLVE_TTL 300
+#define RESOLVE_NEGATIVE_TTL 60
+
+/* keys in the module environment */
+static char resolver_key, resolved_key;
+
+/**
+ * Push the table at key in the module environment, creating it if needed.
+ */
+static void _push_env_table(lua_State *L, void *key)
+{
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, LUA_ENVIRONINDEX);
+    if (lua_isnil(L, -1)) {
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_pushlightuserdata(L, key);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_ENVIRONINDEX);
+    }
+}
+
+/**
+ * Find a name in the resolution cache.  The cache maps names to tables
+ * { address or false, expiry time }; its entry 1 holds the number of names.
+ *
+ * @return  1 and the address (or NULL if the name didn't resolve) in *addr,
+ *  or 0 if the name is not cached.
+ */
+static int _resolved_find(lua_State *L, const char *name, const char **addr)
+{
+    int found = 0;
+
+    _push_env_table(L, &resolved_key);
+    lua_getfield(L, -1, name);
+    if (lua_istable(L, -1)) {
+	lua_rawgeti(L, -1, 2);
+	if (lua_tonumber(L, -1) >= time(NULL)) {
+	    lua_rawgeti(L, -2, 1);
+	    /* the string is kept alive by the cache entry */
+	    *addr = lua_tostring(L, -1);
+	    lua_pop(L, 1);
+	    found = 1;
+	}
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return found;
+}
+
+/* add to the resolution cache, which is emptied when it is full */
+static void _resolved_add(lua_State *L, const char *name, const char *addr)
+{
+    int n;
+
+    _push_env_table(L, &resolved_key);
+    lua_rawgeti(L, -1, 1);
+    n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (n >= RESOLVE_ENTRIES) {
+	lua_pop(L, 1);
+	lua_pushlightuserdata(L, &resolved_key);
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_insert(L, -3);
+	lua_rawset(L, LUA_ENVIRONINDEX);
+	n = 0;
+    }
+
+    lua_createtable(L, 2, 0);
+    if (addr)
+	lua_pushstring(L, addr);
+    else
+	lua_pushboolean(L, 0);
+    lua_rawseti(L, -2, 1);
+    lua_pushnumber(L, time(NULL) + (addr ? RESOLVE_TTL : RESOLVE_NEGATIVE_TTL));
+    lua_rawseti(L, -2, 2);
+    lua_setfield(L, -2, name);
+    lua_pushinteger(L, n + 1);
+    lua_rawseti(L, -2, 1);
+    lua_pop(L, 1);
+}
+
+/**
+ * Finish an asynchronous lookup: look up addr (NULL if the name didn't
+ * resolve) and call the callback with the result or nil.
+ *
+ * @param index  Stack index of the GeoIP object
+ * @param callback  Stack index of the callback
+ */
+static void _async_done(lua_State *L, int index, int callback,
+    const char *addr)
+{
+    lua_geoip *lgi = (lua_geoip*) lua_touserdata(L, index);
+    Addr a;
+
+    lua_pushvalue(L, callback);
+    _push_result_metatable(L);
+    if (!addr || !_parse_addr(addr, &a)
+	|| !_push_lookup_addr(L, lgi, index, &a, -1))
+	lua_pushnil(L);
+    lua_remove(L, -2);
+    lua_call(L, 1, 0);
+}
+
+/**
+ * The function given to the resolver hook.  The GeoIP object, the name and
+ * the callback are upvalues.
+ *
+ * @param addr  The address of the name as string, or nil if it didn't
+ *  resolve.
+ */
+static int l_async_resolved(lua_State *L)
+{
+    const char *addr = lua_tostring(L, 1);
+
+    lua_settop(L, 1);
+    _resolved_add(L, lua_tostring(L, lua_upvalueindex(2)), addr);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    _async_done(L, 2, lua_upvalueindex(3), addr);
+    return 0;
+}
+
+#ifdef HAVE_GETADDRINFO_A
+
+/* key of the table of pending requests in the module environment */
+static char pending_key;
+
+/* a request of getaddrinfo_a, with its name and hints */
+typedef struct {
+    struct gaicb cb;
+    struct addrinfo hints;
+    char name[1];
+} AsyncRequest;
+
+/**
+ * Start resolving the name with getaddrinfo_a.  The request is kept in the
+ * pending table with { GeoIP object, name, callback }, see l_poll.
+ */
+static void _async_start(lua_State *L, lua_geoip *lgi, const char *name)
+{
+    struct gaicb *list[1];
+    AsyncRequest *req;
+    int rc;
+
+    if (!(req = (AsyncRequest*) calloc(1, sizeof(*req) + strlen(name))))
+	luaL_error(L, "out of memory");
+    strcpy(req->name, name);
+    req->hints.ai_family = _is_v6(lgi) ? AF_INET6 : AF_INET;
+    req->hints.ai_socktype = SOCK_STREAM;
+    req->cb.ar_name = req->name;
+    req->cb.ar_request = &req->hints;
+    list[0] = &req->cb;
+    if ((rc = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL))) {
+	free(req);
+	luaL_error(L, "can't resolve %s: %s", name, gai_strerror(rc));
+    }
+
+    _push_env_table(L, &pending_key);
+    lua_pushlightuserdata(L, req);
+    lua_createtable(L, 3, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 2);
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, 3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+/**
+ * Finish the asynchronous lookups whose names have been resolved by
+ * getaddrinfo_a, and call their callbacks.  Call this regularly from the
+ * event loop.
+ *
+ * @return  The number of lookups that are still pending.
+ */
+static int l_poll(lua_State *L)
+{
+    char addr[INET6_ADDRSTRLEN];
+    struct addrinfo *ai;
+    AsyncRequest *req;
+    int i, n = 0, pending = 0;
+    const void *sa;
+
+    lua_settop(L, 0);
+    _push_env_table(L, &pending_key);		/* 1 */
+    lua_newtable(L);				/* 2: finished requests */
+
+    /* collect first, as callbacks may start new lookups */
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+	req = (AsyncRequest*) lua_touserdata(L, -2);
+	if (gai_error(&req->cb) == EAI_INPROGRESS) {
+	    pending++;
+	    lua_pop(L, 1);
+	    continue;
+	}
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, 2, ++n);
+	lua_pop(L, 1);
+    }
+
+    for (i=1; i<=n; i++) {
+	lua_settop(L, 2);
+	lua_rawgeti(L, 2, i);			/* 3: the request */
+	req = (AsyncRequest*) lua_touserdata(L, 3);
+	lua_pushvalue(L, 3);
+	lua_rawget(L, 1);			/* 4: the entry */
+	lua_pushvalue(L, 3);
+	lua_pushnil(L);
+	lua_rawset(L, 1);
+
+	ai = gai_error(&req->cb) ? NULL : req->cb.ar_result;
+	sa = !ai ? NULL : ai->ai_family == AF_INET6
+	    ? (void*) &((struct sockaddr_in6*) ai->ai_addr)->sin6_addr
+	    : (void*) &((struct sockaddr_in*) ai->ai_addr)->sin_addr;
+	if (sa && !inet_ntop(ai->ai_family, sa, addr, sizeof(addr)))
+	    sa = NULL;
+	if (ai)
+	    freeaddrinfo(ai);
+	free(req);
+
+	lua_rawgeti(L, 4, 1);			/* 5: GeoIP object */
+	lua_rawgeti(L, 4, 2);			/* 6: name */
+	lua_rawgeti(L, 4, 3);			/* 7: callback */
+	_resolved_add(L, lua_tostring(L, 6), sa ? addr : NULL);
+	_async_done(L, 5, 7, sa ? addr : NULL);
+    }
+
+    lua_pushinteger(L, pending);
+    return 1;
+}
+
+#endif
+
+/**
+ * Look up a host name without blocking.  The callback is called with the
+ * Result, or nil if the name can't be resolved or nothing was found.  For IP
+ * addresses and names in the resolution cache, this happens right away.
+ * Otherwise, the name is resolved by the resolver hook (see
+ * l_set_resolver) or, if built with HAVE_GETADDRINFO_A, by getaddrinfo_a,
+ * whose results are handled by geoip.poll.
+ *
+ * @param gi  GeoIP object
+ * @param name  Host name or IP address to look up
+ * @param callback  Function called with the Result or nil
+ */
+static int l_geoip_lookup_async(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *name = luaL_checkstring(L, 2), *addr;
+    Addr a;
+
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 3);
+
+    if (_parse_addr(name, &a)) {
+	_async_done(L, 1, 3, name);
+	return 0;
+    }
+
+    if (_resolved_find(L, name, &addr)) {
+	_async_done(L, 1, 3, addr);
+	return 0;
+    }
+
+    _push_env_table(L, &resolver_key);
+    lua_rawgeti(L, -1, 1);
+    if (lua_isfunction(L, -1)) {
+	lua_pushvalue(L, 2);
+	lua_pushstring(L, _is_v6(lgi) ? "inet6" : "inet");
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_pushcclosure(L, l_async_resolved, 3);
+	lua_call(L, 3, 0);
+	return 0;
+    }
+
+#ifdef HAVE_GETADDRINFO_A
+    lua_settop(L, 3);
+    _async_start(L, lgi, name);
+    return 0;
+#else
+    return luaL_error(L, "no asynchronous resolver, see geoip.set_resolver");
+#endif
+}
+
+/**
+ * Set the function that resolves names for lookup_async, so that the event
+ * loop of the application can do it.  It is called with the name, the
+ * address family ("inet" or "inet6") and a function, which it must call
+ * later with the address as string, or nil if the name doesn't resolve.
+ * Results are kept for a few minutes, failures for one minute.
+ *
+ * @param resolver  The function, or nil to remove it
+ */
+static int l_set_resolver(lua_State *L)
+{
+    if (!lua_isnil(L, 1))
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_settop(L, 1);
+    _push_env_table(L, &resolver_key);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    return 0;
+}
+
+
+/**
+ * Look up many host names or IP addresses in one call.  They can be given
+ * either as an array or as separate arguments.  The metatable check and the
+ * setup of the result metatable is done only once for the whole batch.
+ *
+ * With an array, an options table may follow.  Its field "threads" sets the
+ * number of threads that look up the numeric addresses in parallel; this
+ * needs a database opened with cache mode "memory" or "mmap", and doesn't
+ * use the lookup cache.  With "sorted" set, lookup_sorted is used instead.
+ *
+ * @param gi  GeoIP object
+ * @param names  Array of host names or IP addresses, or name...
+ * @param options  (optional) Table with options, see above.
+ * @return  An array with one entry per name: a Result object, or false if
+ *  the lookup failed.
+ */
+static int l_geoip_lookup_many(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    int i, n, is_table = lua_istable(L, 2), threads = 1;
+    const char *hostname;
+
+    if (is_table && lua_istable(L, 3)) {
+	lua_getfield(L, 3, "sorted");
+	if (lua_toboolean(L, -1)) {
+	    lua_settop(L, 2);
+	    return l_geoip_lookup_sorted(L);
+	}
+	lua_getfield(L, 3, "threads");
+	threads = luaL_optint(L, -1, 1);
+	luaL_argcheck(L, threads >= 1 && threads <= POOL_MAX_THREADS, 3,
+	    "invalid number of threads");
+	lua_settop(L, 2);
+    }
+
+    n = is_table ? lua_objlen(L, 2) : lua_gettop(L) - 1;
+    if (threads > 1 && n > 0)
+	return _lookup_many_threads(L, lgi, n, threads);
+
+    lua_createtable(L, n, 0);
+    _push_result_metatable(L);
+    for (i=1; i<=n; i++) {
+	if (is_table) {
+	    lua_rawgeti(L, 2, i);
+	    if (!(hostname = lua_tostring(L, -1)))
+		return luaL_error(L, "bad entry #%d in lookup_many (string"
+		    " expected)", i);
+	} else {
+	    hostname = luaL_checkstring(L, i + 1);
+	    lua_pushnil(L);
+	}
+
+	if (!_push_lookup(L, lgi, 1, hostname, -2))
+	    lua_pushboolean(L, 0);
+	lua_rawseti(L, -4, i);
+	lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+    return 1;
+}
+
+
+/**
+ * Returns the database type in use.
+ */
+static int l_geoip_tostring(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    lua_pushstring(L, GeoIPDBDescription[(int)lgi->gi->databaseType]);
+    return 1;
+}
+
+
+/**
+ * Databases loaded with GEOIP_MEMORY_CACHE or GEOIP_MMAP_CACHE are not
+ * modified by lookups, so they are shared by all GeoIP objects (in all Lua
+ * states of the process) that open the same file with the same flags.  Each
+ * entry of this registry counts its users; the file is identified by its
+ * real path, and a new version of it (different inode, size or mtime) gets
+ * a new entry.
+ */
+typedef struct shared_db_t {
+    struct shared_db_t *next;
+    char *path;
+    int flags;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    GeoIP *gi;
+    int refs;
+} SharedDB;
+
+static SharedDB *shared_dbs;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Whether a database opened with these flags can be shared by threads.  The
+ * data isn't reloaded then, but libGeoIP still stores the last netmask in
+ * the struct on every lookup, and copies it into the netmask of city
+ * records; neither must be relied on with a shared database.
+ */
+static int _is_shareable(int flags)
+{
+    return (flags & (GEOIP_MEMORY_CACHE | GEOIP_MMAP_CACHE))
+	&& !(flags & GEOIP_CHECK_CACHE);
+}
+
+
+/**
+ * libGeoIP prints error messages (e.g. failure to open a data file) on stderr
+ * instead of returning it somehow.  Check beforehand that the file can be
+ * read to get a proper error message, and ask libGeoIP to be silent.  This
+ * doesn't touch the Lua state, so it can be called with a lock held.
+ *
+ * @param err  Set to errno, or to 0 if the file is not a GeoIP database.
+ * @return  The GeoIP state, or NULL.
+ */
+static GeoIP *_try_open(const char *path, int flags, int *err)
+{
+    GeoIP *gi;
+
+    if (access(path, R_OK)) {
+	*err = errno;
+	return NULL;
+    }
+
+    if (!(gi = GeoIP_open(path, flags | GEOIP_SILENCE)))
+	*err = 0;
+    return gi;
+}
+
+static void _push_open_error(lua_State *L, const char *path, int err)
+{
+    if (err)
+	lua_pushfstring(L, "cannot open %s: %s", path, strerror(err));
+    else
+	lua_pushfstring(L, "cannot open %s: not a valid GeoIP database",
+	    path);
+}
+
+
+/**
+ * Open a database file, or use the already loaded copy from the registry of
+ * shared databases.  Close it with _close_db.  Like _try_open, this doesn't
+ * touch a Lua state, so it can run on another thread.
+ *
+ * @param err  Set on failure, see _try_open.
+ * @return  The GeoIP state, or NULL.
+ */
+static GeoIP *_open_shared(const char *path, int flags, int *err)
+{
+    struct stat st;
+    SharedDB *db;
+    char *real;
+    GeoIP *gi;
+
+    if (!_is_shareable(flags))
+	return _try_open(path, flags, err);
+
+    if (!(real = realpath(path, NULL)) || stat(real, &st)) {
+	*err = errno;
+	free(real);
+	return NULL;
+    }
+
+    pthread_mutex_lock(&shared_lock);
+    for (db=shared_dbs; db; db=db->next)
+	if (db->flags == flags && !strcmp(db->path, real))
+	    break;
+
+    if (db && db->dev == st.st_dev && db->ino == st.st_ino
+	&& db->size == st.st_size && db->mtime == st.st_mtime) {
+	db->refs++;
+	gi = db->gi;
+    } else if ((gi = _try_open(real, flags, err))) {
+	SharedDB *new_db = (SharedDB*) malloc(sizeof(*new_db));
+	if (new_db) {
+	    /* an outdated entry stays until its last user is gone */
+	    if (db)
+		db->path[0] = 0;
+	    new_db->next = shared_dbs;
+	    new_db->path = real;
+	    new_db->flags = flags;
+	    new_db->dev = st.st_dev;
+	    new_db->ino = st.st_ino;
+	    new_db->size = st.st_size;
+	    new_db->mtime = st.st_mtime;
+	    new_db->gi = gi;
+	    new_db->refs = 1;
+	    shared_dbs = new_db;
+	    real = NULL;
+	}
+	/* else it is just not shared */
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    free(real);
+    return gi;
+}
+
+/**
+ * @return  The GeoIP state, or NULL with an error message pushed.
+ */
+static GeoIP *_open_file(lua_State *L, const char *path, int flags)
+{
+    GeoIP *gi;
+    int err;
+
+    /* pushed only now: a memory error must not leave shared_lock held */
+    if (!(gi = _open_shared(path, flags, &err)))
+	_push_open_error(L, path, err);
+    return gi;
+}
+
+
+/**
+ * Release a database opened with _open_file.
+ */
+static void _close_db(GeoIP *gi)
+{
+    SharedDB *db, **prev;
+    int last = 1;
+
+    pthread_mutex_lock(&shared_lock);
+    for (prev=&shared_dbs; (db=*prev); prev=&db->next)
+	if (db->gi == gi)
+	    break;
+    if (db && (last = --db->refs == 0)) {
+	*prev = db->next;
+	free(db->path);
+	free(db);
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    if (last)
+	GeoIP_delete(gi);
+}
+
+
+/**
+ * Options given to the open functions, see _check_options.
+ */
+typedef struct {
+    int flags;		/* for libGeoIP */
+    int cache_entries;	/* size of the lookup cache */
+    int flat;		/* build the flat index */
+    FlatIndex *image;	/* mapped image, see _open_image */
+} Options;
+
+static int _open_common(lua_State *L, GeoIP *gi, const char *path,
+    Options *opt);
+static int _open_image(lua_State *L, const char *path, Options *opt);
+static void _reload_cancel(lua_geoip *lgi);
+
+
+/**
+ * Clean up after using a GeoIP database.  Even after this, existing
+ * results seem to continue to work.
+ */
+static int l_geoip_gc(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+
+    _reload_cancel(lgi);
+    if (lgi->gi) {
+	if (_is_image(lgi))
+	    free(lgi->gi);
+	else
+	    _close_db(lgi->gi);
+	lgi->gi = NULL;
+    }
+    if (lgi->cache) {
+	cache_free(lgi->cache);
+	lgi->cache = NULL;
+    }
+    if (lgi->path) {
+	free(lgi->path);
+	lgi->path = NULL;
+    }
+    if (lgi->flat) {
+	flat_free(lgi->flat);
+	lgi->flat = NULL;
+    }
+    return 0;
+}
+
+
+/**
+ * Look up an IPv4 address and return just a number that identifies the
+ * result, and the network that it belongs to.  All addresses from first to
+ * last give the same result, so they need not be looked up again.
+ *
+ * For country databases, id is the country id (0 if unknown), which can be
+ * given to geoip.country_code and friends; for netspeed databases, it is
+ * the netspeed id.  For city databases, it is the first address of the
+ * network; with a database that is shared by threads, the netmask in the
+ * record can't be trusted (see _is_shareable), so the network is just the
+ * address itself.  Other database types are not supported.
+ *
+ * @param gi  GeoIP object
+ * @param addr  IPv4 address like "74.125.67.100", or as number
+ * @return  id, first and last address as numbers; or nil if addr is not an
+ *  IPv4 address or nothing was found.
+ */
+static int l_geoip_id(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    GeoIP *gi = lgi->gi;
+    unsigned long ipnum, first, last;
+    GeoIPRecord *r;
+    int id;
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+	lua_Number n = lua_tonumber(L, 2);
+	luaL_argcheck(L, n >= 0 && n <= 4294967295.0, 2,
+	    "not an IPv4 address");
+	ipnum = (unsigned long) n;
+    } else if (!_parse_ipv4(luaL_checkstring(L, 2), &ipnum))
+	return 0;
+
+    switch (gi->databaseType) {
+	case GEOIP_COUNTRY_EDITION:
+	case GEOIP_NETSPEED_EDITION:
+	if ((id = _id_range(lgi, ipnum, &first, &last)) < 0)
+	    return luaL_error(L, "can't read the database %s", lgi->path);
+	break;
+
+	case GEOIP_CITY_EDITION_REV0:
+	case GEOIP_CITY_EDITION_REV1:
+	lgi->stats.lookups++;
+	if (!(r = GeoIP_record_by_ipnum(gi, ipnum))) {
+	    lgi->stats.misses++;
+	    return 0;
+	}
+	if (_is_shareable(lgi->flags))
+	    first = last = ipnum;
+	else
+	    _netmask_range(ipnum, r->netmask, &first, &last);
+	GeoIPRecord_delete(r);
+	id = (int) first;
+	break;
+
+	default:
+	return luaL_error(L, "id is not supported for this database type");
+    }
+
+    lua_pushnumber(L, gi->databaseType == GEOIP_CITY_EDITION_REV0
+	|| gi->databaseType == GEOIP_CITY_EDITION_REV1 ? first : id);
+    lua_pushnumber(L, first);
+    lua_pushnumber(L, last);
+    return 3;
+}
+
+
+/**
+ * Build the flat index for a country database, which makes lookups of
+ * numeric addresses faster.  This takes a moment and about 1 MB of memory.
+ *
+ * @param gi  GeoIP object
+ * @return  The number of address ranges in the index.
+ */
+static int l_geoip_compile(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    FlatIndex *fi;
+
+    if (_is_image(lgi)) {
+	lua_pushinteger(L, lgi->flat->n);
+	return 1;
+    }
+    if (lgi->gi->databaseType != GEOIP_COUNTRY_EDITION)
+	return luaL_error(L, "only IPv4 country databases can be compiled");
+    /* libGeoIP would reload the file behind the index */
+    if (lgi->flags & GEOIP_CHECK_CACHE)
+	return luaL_error(L, "the flat index can't be used with check");
+    if (!(fi = flat_build(lgi->gi)))
+	return luaL_error(L, "can't build the flat index of %s", lgi->path);
+
+    if (lgi->flat)
+	flat_free(lgi->flat);
+    lgi->flat = fi;
+    lua_pushinteger(L, fi->n);
+    return 1;
+}
+
+
+/**
+ * Save the flat index of a compiled country database as an image, which
+ * open_image maps into memory without reading the database again.
+ *
+ * @param gi  GeoIP object
+ * @param path  Name of the image file
+ * @return  true on success; else nil and an error message.
+ */
+static int l_geoip_save_image(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *path = luaL_checkstring(L, 2);
+
+    if (!lgi->flat)
+	return luaL_error(L, "only compiled databases can be saved as image");
+
+    if (image_write(lgi->flat, lgi->gi->databaseType, path)) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "cannot write %s: %s", path, strerror(errno));
+	return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/**
+ * Check the whole data of an object opened by open_image, which open_image
+ * and reload don't, to keep them fast.
+ *
+ * @param gi  GeoIP object
+ * @return  true if the image is intact; else nil and an error message.
+ */
+static int l_geoip_verify_image(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+
+    if (!_is_image(lgi))
+	return luaL_error(L, "not opened from an image");
+    if (!image_verify(lgi->flat)) {
+	lua_pushnil(L);
+	lua_pushfstring(L, "%s is corrupt", lgi->path);
+	return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/**
+ * Empty the lookup cache of the object at index 1 after a reload.  The old
+ * results live on, but are no longer shared.
+ */
+static void _clear_cached_results(lua_State *L, lua_geoip *lgi)
+{
+    Result *r;
+    int i;
+
+    if (!lgi->cache)
+	return;
+
+    lua_getfenv(L, 1);
+    for (i=1; i<=lgi->cache->used; i++) {
+	lua_rawgeti(L, -1, i);
+	if ((r = (Result*) lua_touserdata(L, -1)))
+	    r->cached = 0;
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    lua_createtable(L, lgi->cache->size, 0);
+    lua_setfenv(L, 1);
+    cache_clear(lgi->cache);
+}
+
+/**
+ * Reload for an object opened by open_image: map the image again.
+ */
+static int _reload_image(lua_State *L, lua_geoip *lgi, const char *path)
+{
+    FlatIndex *fi;
+    char *new_path;
+    time_t mtime;
+
+    if (!(fi = image_map(L, path, &mtime)))
+	return luaL_error(L, "%s", lua_tostring(L, -1));
+    if (!(new_path = strdup(path))) {
+	flat_free(fi);
+	return luaL_error(L, "out of memory");
+    }
+
+    flat_free(lgi->flat);
+    lgi->flat = fi;
+    lgi->gi->mtime = lgi->mtime = mtime;
+    lgi->reloads++;
+    free(lgi->path);
+    lgi->path = new_path;
+    _clear_cached_results(L, lgi);
+    lua_settop(L, 1);
+    return 1;
+}
+
+
+/**
+ * Loading a new version of the database, by reload on the calling thread or
+ * by reload_async on a thread of its own.  The loading doesn't touch the Lua
+ * state; _reload_finish then puts the new database in place.
+ */
+typedef struct reload_t {
+    pthread_t thread;
+    char *path;		/* of the new file */
+    int flags;		/* of the GeoIP object */
+    int type;		/* database type the file must have */
+    int flat;		/* build the flat index too */
+    GeoIP *gi;		/* the new database, and its index */
+    FlatIndex *fi;
+    int status;		/* one of RELOAD_* */
+    int err;		/* errno of RELOAD_OPEN, see _try_open */
+    int done;		/* set when the loading thread is finished */
+} Reload;
+
+enum { RELOAD_OK, RELOAD_OPEN, RELOAD_TYPE, RELOAD_INDEX };
+
+static void *_reload_load(void *arg)
+{
+    Reload *rl = (Reload*) arg;
+
+    if (!(rl->gi = _open_shared(rl->path, rl->flags, &rl->err)))
+	rl->status = RELOAD_OPEN;
+    else if (rl->gi->databaseType != rl->type)
+	rl->status = RELOAD_TYPE;
+    else if (rl->flat && !(rl->fi = flat_build(rl->gi)))
+	rl->status = RELOAD_INDEX;
+    else
+	rl->status = RELOAD_OK;
+
+    if (rl->status != RELOAD_OK && rl->gi) {
+	_close_db(rl->gi);
+	rl->gi = NULL;
+    }
+    __sync_lock_test_and_set(&rl->done, 1);
+    return NULL;
+}
+
+/* set up rl for reloading lgi from path; the path is copied */
+static int _reload_init(Reload *rl, lua_geoip *lgi, const char *path)
+{
+    memset(rl, 0, sizeof(*rl));
+    if (!(rl->path = strdup(path)))
+	return 0;
+    rl->flags = lgi->flags;
+    rl->type = lgi->gi->databaseType;
+    rl->flat = lgi->flat != NULL;
+    return 1;
+}
+
+/**
+ * Put the database loaded by _reload_load in place.  Existing results don't
+ * refer to the database and stay valid; the lookup cache is emptied.
+ *
+ * @return  1 on success, else 0 with an error message pushed.  Either way,
+ *  the resources of rl have been taken over or freed.
+ */
+static int _reload_finish(lua_State *L, lua_geoip *lgi, Reload *rl)
+{
+    switch (rl->status) {
+	case RELOAD_OPEN:
+	_push_open_error(L, rl->path, rl->err);
+	break;
+
+	case RELOAD_TYPE:
+	lua_pushfstring(L, "%s has a different database type", rl->path);
+	break;
+
+	case RELOAD_INDEX:
+	lua_pushfstring(L, "can't build the flat index of %s", rl->path);
+	break;
+
+	default:
+	_close_db(lgi->gi);
+	lgi->gi = rl->gi;
+	if (rl->fi) {
+	    flat_free(lgi->flat);
+	    lgi->flat = rl->fi;
+	}
+	lgi->mtime = rl->gi->mtime;
+	lgi->reloads++;
+	free(lgi->path);
+	lgi->path = rl->path;
+	_clear_cached_results(L, lgi);
+	return 1;
+    }
+
+    free(rl->path);
+    return 0;
+}
+
+/* wait for a reload_async that is still running, and drop its result */
+static void _reload_cancel(lua_geoip *lgi)
+{
+    Reload *rl = lgi->reloading;
+
+    if (!rl)
+	return;
+    pthread_join(rl->thread, NULL);
+    if (rl->gi)
+	_close_db(rl->gi);
+    if (rl->fi)
+	flat_free(rl->fi);
+    free(rl->path);
+    free(rl);
+    lgi->reloading = NULL;
+}
+
+
+/**
+ * Replace the database with a new version of the file (or another file of
+ * the same type).  The new file is opened completely before the old one is
+ * closed, so the GeoIP object can be used all the time.  Existing results
+ * don't refer to the database and stay valid; the lookup cache is emptied.
+ * Loading the file blocks the caller; see reload_async to avoid that.
+ *
+ * @param gi  GeoIP object
+ * @param path  (optional) The file to open; default is the current one.
+ * @return  The GeoIP object.
+ */
+static int l_geoip_reload(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *path = luaL_optstring(L, 2, lgi->path);
+    Reload rl;
+
+    if (lgi->reloading)
+	return luaL_error(L, "a reload_async is in progress");
+    if (_is_image(lgi))
+	return _reload_image(L, lgi, path);
+    if (!_reload_init(&rl, lgi, path))
+	return luaL_error(L, "out of memory");
+
+    _reload_load(&rl);
+    if (!_reload_finish(L, lgi, &rl))
+	return lua_error(L);
+    lua_settop(L, 1);
+    return 1;
+}
+
+
+/**
+ * Start to load a new version of the database on a thread of its own, so
+ * that lookups go on meanwhile.  The new database is put in place by a
+ * later call of reload_poll.  An image is mapped right away, as that takes
+ * no time.
+ *
+ * @param gi  GeoIP object
+ * @param path  (optional) The file to open; default is the current one.
+ * @return  true
+ */
+static int l_geoip_reload_async(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    const char *path = luaL_optstring(L, 2, lgi->path);
+    Reload *rl;
+
+    if (lgi->reloading)
+	return luaL_error(L, "a reload_async is in progress");
+    if (_is_image(lgi)) {
+	_reload_image(L, lgi, path);
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+
+    if (!(rl = (Reload*) malloc(sizeof(*rl))))
+	return luaL_error(L, "out of memory");
+    if (!_reload_init(rl, lgi, path)) {
+	free(rl);
+	return luaL_error(L, "out of memory");
+    }
+    if (pthread_create(&rl->thread, NULL, _reload_load, rl)) {
+	free(rl->path);
+	free(rl);
+	return luaL_error(L, "can't start a thread for the reload");
+    }
+    lgi->reloading = rl;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/**
+ * Put the database loaded by reload_async in place once it is ready.
+ *
+ * @param gi  GeoIP object
+ * @return  false while the database is still being loaded; true when it
+ *  is in use, or if no reload_async is pending; nil and an error message if
+ *  loading it failed.
+ */
+static int l_geoip_reload_poll(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    Reload *rl = lgi->reloading;
+    int ok;
+
+    if (rl && !__sync_fetch_and_add(&rl->done, 0)) {
+	lua_pushboolean(L, 0);
+	return 1;
+    }
+    if (!rl) {
+	lua_pushboolean(L, 1);
+	return 1;
+    }
+
+    pthread_join(rl->thread, NULL);
+    lgi->reloading = NULL;
+    ok = _reload_finish(L, lgi, rl);
+    free(rl);
+    if (!ok) {
+	lua_pushnil(L);
+	lua_insert(L, -2);
+	return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/**
+ * Create another GeoIP object for the same database with the same options,
+ * e.g. for use by another thread.  A shared database (cache mode memory or
+ * mmap) isn't loaded again; otherwise the file is opened again, so that
+ * each object has its own file position and buffers.  The lookup cache, if
+ * any, is not shared.
+ *
+ * @param gi  GeoIP object
+ * @return  A new GeoIP object.
+ */
+static int l_geoip_clone(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    Options opt;
+
+    opt.flags = lgi->flags;
+    opt.cache_entries = lgi->cache ? lgi->cache->size : 0;
+    opt.flat = lgi->flat != NULL;
+    opt.image = NULL;
+    if (_is_image(lgi))
+	return _open_image(L, lgi->path, &opt);
+    return _open_common(L, _open_file(L, lgi->path, lgi->flags), lgi->path,
+	&opt);
+}
+
+
+/**
+ * Return information about the database file.
+ *
+ * @return  A table with the fields path, shared (whether the database is
+ *  shared and can be used by several threads), mtime (of the file when it
+ *  was loaded), reloads (number of calls to reload) and check_reloads
+ *  (number of times libGeoIP has reloaded the file by itself, see the
+ *  "check" option).
+ */
+static int l_geoip_info(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, lgi->path);
+    lua_setfield(L, -2, "path");
+    lua_pushboolean(L, _is_shareable(lgi->flags));
+    lua_setfield(L, -2, "shared");
+    lua_pushnumber(L, lgi->mtime);
+    lua_setfield(L, -2, "mtime");
+    lua_pushnumber(L, lgi->reloads);
+    lua_setfield(L, -2, "reloads");
+    lua_pushnumber(L, lgi->check_reloads);
+    lua_setfield(L, -2, "check_reloads");
+    return 1;
+}
+
+
+/**
+ * Return the counters of the lookup cache.
+ *
+ * @return  A table with the fields hits, misses, entries and size, or nil
+ *  if the GeoIP object has no lookup cache.
+ */
+static int l_geoip_cache_stats(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    Cache *c = lgi->cache;
+
+    if (!c)
+	return 0;
+
+    lua_createtable(L, 0, 4);
+    lua_pushnumber(L, c->hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushnumber(L, c->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, c->used);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, c->size);
+    lua_setfield(L, -2, "size");
+    return 1;
+}
+
+/**
+ * Return the counters of this object.  These are: type (the database type),
+ * lookups (queries of the database), misses (of them with nothing found),
+ * resolves (of them by host name, i.e. not an IP address), the hits and
+ * misses of the lookup cache if enabled, and for the timed queries: timed
+ * (their number), sampled_ns (their total time in nanoseconds, so only an
+ * estimate of the total for all queries) and histogram, an array where entry
+ * k counts the queries that took from 2^(k-1) to 2^k nanoseconds.  See
+ * geoip.stats for the counters of the whole process.
+ *
+ * @param gi  GeoIP object
+ * @param options  (optional) Table with "sample", to time every n-th query
+ *  from now on (0 to stop timing), and "reset", to clear the counters after
+ *  returning them.
+ * @return  A table with the counters.
+ */
+static int l_geoip_stats(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    Stats *st = &lgi->stats;
+    int i, reset = 0;
+
+    if (!lua_isnoneornil(L, 2)) {
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "sample");
+	if (!lua_isnil(L, -1)) {
+	    i = luaL_checkint(L, -1);
+	    luaL_argcheck(L, i >= 0, 2, "invalid sample interval");
+	    st->sample = st->countdown = i;
+	}
+	lua_getfield(L, 2, "reset");
+	reset = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+    }
+
+    lua_createtable(L, 0, 10);
+    lua_pushstring(L, GeoIPDBDescription[(int) lgi->gi->databaseType]);
+    lua_setfield(L, -2, "type");
+    lua_pushnumber(L, st->lookups);
+    lua_setfield(L, -2, "lookups");
+    lua_pushnumber(L, st->misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushnumber(L, st->resolves);
+    lua_setfield(L, -2, "resolves");
+    if (lgi->cache) {
+	lua_pushnumber(L, lgi->cache->hits);
+	lua_setfield(L, -2, "cache_hits");
+	lua_pushnumber(L, lgi->cache->misses);
+	lua_setfield(L, -2, "cache_misses");
+    }
+    lua_pushnumber(L, st->timed);
+    lua_setfield(L, -2, "timed");
+    lua_pushnumber(L, (lua_Number) st->sampled_ns);
+    lua_setfield(L, -2, "sampled_ns");
+    lua_createtable(L, STATS_BUCKETS, 0);
+    for (i=0; i<STATS_BUCKETS; i++) {
+	lua_pushnumber(L, st->histogram[i]);
+	lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "histogram");
+
+    if (reset)
+	_stats_reset(st);
+    return 1;
+}
+
+
+/**
+ * Return the counters of the process, i.e. of all Lua states and GeoIP
+ * objects: results_created and results_freed, the number of Result objects
+ * created and collected so far.
+ *
+ * @return  A table with the counters.
+ */
+static int l_stats(lua_State *L)
+{
+    lua_createtable(L, 0, 2);
+    lua_pushnumber(L, __sync_fetch_and_add(&results_created, 0));
+    lua_setfield(L, -2, "results_created");
+    lua_pushnumber(L, __sync_fetch_and_add(&results_freed, 0));
+    lua_setfield(L, -2, "results_freed");
+    return 1;
+}
+
+
+static const luaL_Reg geoip_methods[] = {
+    { "__tostring", l_geoip_tostring },
+    { "__gc", l_geoip_gc },
+    { "lookup", l_geoip_lookup },
+    { "lookup_many", l_geoip_lookup_many },
+    { "lookup_sorted", l_geoip_lookup_sorted },
+    { "lookup_async", l_geoip_lookup_async },
+    { "lookup_table", l_geoip_lookup_table },
+    { "lookup_into", l_geoip_lookup_into },
+    { "prepare", l_geoip_prepare },
+    { "format", l_geoip_format },
+    { "lookup_addr", l_geoip_lookup_addr },
+    { "lookup_ipnum", l_geoip_lookup_ipnum },
+    { "cache_stats", l_geoip_cache_stats },
+    { "stats", l_geoip_stats },
+    { "reload", l_geoip_reload },
+    { "reload_async", l_geoip_reload_async },
+    { "reload_poll", l_geoip_reload_poll },
+    { "info", l_geoip_info },
+    { "clone", l_geoip_clone },
+    { "compile", l_geoip_compile },
+    { "save_image", l_geoip_save_image },
+    { "verify_image", l_geoip_verify_image },
+    { "id", l_geoip_id },
+    { NULL, NULL }
+};
+
+
+/**
+ * A GeoIP state has been created; now set up a userdata with metatable
+ * to let Lua scripts access it.  If the state is NULL, raise the error
+ * message on top of the stack.
+ */
+static int _open_common(lua_State *L, GeoIP *gi, const char *path,
+    Options *opt)
+{
+    lua_geoip *lgi;
+
+    if (!gi)
+	return luaL_error(L, "%s", lua_tostring(L, -1));
+
+    lgi = (lua_geoip*) lua_newuserdata(L, sizeof(*lgi));
+    memset(lgi, 0, sizeof(*lgi));
+    lgi->gi = gi;
+    lgi->flat = opt->image;	/* set now, so that __gc knows gi is a stub */
+    lgi->flags = opt->flags;
+    lgi->mtime = gi->mtime;
+
+    if (luaL_newmetatable(L, GEOIP)) {
+	luaL_register(L, NULL, geoip_methods);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    if (!(lgi->path = strdup(path)))
+	return luaL_error(L, "out of memory");
+
+    if (opt->cache_entries > 0) {
+	if (!(lgi->cache = cache_new(opt->cache_entries)))
+	    return luaL_error(L, "out of memory for the lookup cache");
+	/* holds the cached results */
+	lua_createtable(L, opt->cache_entries, 0);
+	lua_setfenv(L, -2);
+    }
+
+    if (opt->flat) {
+	if (gi->databaseType != GEOIP_COUNTRY_EDITION)
+	    return luaL_error(L, "only IPv4 country databases can be compiled");
+	if (!(lgi->flat = flat_build(gi)))
+	    return luaL_error(L, "can't build the flat index of %s", path);
+    }
+
+    return 1;
+}
+
+
+/**
+ * Read the options table given to one of the open functions.  The "cache"
+ * option selects how the data file is accessed: "standard" reads from the
+ * file on each lookup, "index" (the default) keeps the index in memory,
+ * "memory" loads the whole file and "mmap" maps it.  With "check" set, the
+ * file is reopened when it changes.  "cache_entries" is the number of
+ * addresses to keep in the lookup cache of the GeoIP object.  With "threads"
+ * set, the database must be opened in a mode that can be used by several
+ * threads at once, i.e. "memory" or "mmap" without "check".  With "index"
+ * set to "flat", a country database is compiled right away; this excludes
+ * "check".
+ */
+static void _check_options(lua_State *L, int index, Options *opt)
+{
+    static const char *const cache_names[] = { "standard", "index", "memory",
+	"mmap", NULL };
+    static const int cache_flags[] = { GEOIP_STANDARD, GEOIP_INDEX_CACHE,
+	GEOIP_MEMORY_CACHE, GEOIP_MMAP_CACHE };
+    const char *cache;
+    int i;
+
+    opt->flags = GEOIP_INDEX_CACHE;
+    opt->cache_entries = 0;
+    opt->flat = 0;
+    opt->image = NULL;
+    if (lua_isnoneornil(L, index))
+	return;
+    luaL_checktype(L, index, LUA_TTABLE);
+
+    lua_getfield(L, index, "cache");
+    cache = luaL_optstring(L, -1, "index");
+    for (i=0; cache_names[i] && strcmp(cache_names[i], cache); i++)
+	;
+    if (!cache_names[i])
+	luaL_error(L, "invalid cache mode %s (standard, index, memory"
+	    " or mmap)", cache);
+    opt->flags = cache_flags[i];
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "check");
+    if (lua_toboolean(L, -1))
+	opt->flags |= GEOIP_CHECK_CACHE;
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "cache_entries");
+    opt->cache_entries = luaL_optint(L, -1, 0);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "index");
+    if (!lua_isnil(L, -1)) {
+	if (strcmp(luaL_checkstring(L, -1), "flat"))
+	    luaL_error(L, "invalid index %s (flat)", lua_tostring(L, -1));
+	if (opt->flags & GEOIP_CHECK_CACHE)
+	    luaL_error(L, "the flat index can't be used with check");
+	opt->flat = 1;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "threads");
+    if (lua_toboolean(L, -1) && !_is_shareable(opt->flags))
+	luaL_error(L, "the threads option needs cache mode memory or mmap"
+	    " without check");
+    lua_pop(L, 1);
+}
+
+
+/**
+ * The names of the database types accepted by open_type.
+ */
+typedef struct {
+    const char *name;
+    GeoIPDBTypes type;
+} DBType;
+
+static const DBType db_types[] = {
+    { "city", GEOIP_CITY_EDITION_REV1 },
+    { "country", GEOIP_COUNTRY_EDITION },
+    { "region", GEOIP_REGION_EDITION_REV1 },
+    { "org", GEOIP_ORG_EDITION },
+    { "isp", GEOIP_ISP_EDITION },
+    { "asnum", GEOIP_ASNUM_EDITION },
+    { "netspeed", GEOIP_NETSPEED_EDITION },
+    { "city_rev0", GEOIP_CITY_EDITION_REV0 },
+    { "region_rev0", GEOIP_REGION_EDITION_REV0 },
+    { "country_v6", GEOIP_COUNTRY_EDITION_V6 },
+    { "city_v6", GEOIP_CITY_EDITION_REV1_V6 },
+    { NULL }
+};
+
+
+/**
+ * Open a GeoIP database file by specifying the desired type(s).  The default
+ * file name for each type will be used.  The first successfully opened
+ * database is used.  If none of the types are available, raise an error.
+ *
+ * @param type...  The database type(s) to open.
+ * @param options  (optional) Table with options, see _check_options.
+ * @return  A GeoIP object or nil on error.
+ */
+static int l_open_type(lua_State *L)
+{
+    int i, n = lua_gettop(L);
+    const DBType *t;
+    GeoIP *gi = NULL;
+    Options opt;
+
+    _check_options(L, n && lua_istable(L, n) ? n-- : n + 1, &opt);
+    lua_pushliteral(L, "no database type given");
+
+    for (i = 1; i<=n; i++) {
+	const char *type_name = luaL_checkstring(L, i);
+
+	for (t=db_types; t->name && strcmp(t->name, type_name); t++)
+	    ;
+	if (!t->name)
+	    return luaL_error(L, "invalid type %s (city, country, region, org,"
+		" isp, asnum, netspeed, city_rev0, region_rev0, country_v6 or"
+		" city_v6)", type_name);
+
+	lua_pop(L, 1);
+	if (!GeoIP_db_avail(t->type))
+	    lua_pushfstring(L, "no %s database available", type_name);
+	else if ((gi = _open_file(L, GeoIPDBFileName[t->type], opt.flags)))
+	    break;
+    }
+
+    return _open_common(L, gi, gi ? GeoIPDBFileName[t->type] : NULL, &opt);
+}
+
+
+/**
+ * Open a GeoIP database file.
+ *
+ * @param fname  Name of the file to open (including path)
+ * @param options  (optional) Table with options, see _check_options.
+ * @return  A GeoIP object or nil on error.
+ */
+static int l_open(lua_State *L)
+{
+    const char *filename = luaL_checkstring(L, 1);
+    Options opt;
+
+    _check_options(L, 2, &opt);
+    return _open_common(L, _open_file(L, filename, opt.flags), filename,
+	&opt);
+}
+
+
+static int _open_image(lua_State *L, const char *path, Options *opt)
+{
+    FlatIndex *fi;
+    time_t mtime;
+    GeoIP *gi;
+
+    if (!(fi = image_map(L, path, &mtime)))
+	return luaL_error(L, "%s", lua_tostring(L, -1));
+    if (!(gi = image_stub(mtime))) {
+	flat_free(fi);
+	return luaL_error(L, "out of memory");
+    }
+
+    opt->image = fi;
+    opt->flat = 0;
+    opt->flags = GEOIP_MEMORY_CACHE;
+    return _open_common(L, gi, path, opt);
+}
+
+
+/**
+ * Open an image written by save_image.  The file is mapped into memory and
+ * used as it is, so this is much faster than opening the database.  The
+ * object works like one for the database compiled with index "flat", except
+ * that host names are resolved before the lookup.
+ *
+ * @param filename  Name of the image file
+ * @param options  (optional) Table with options, of which only
+ *  "cache_entries" is used.
+ * @return  A GeoIP object.
+ */
+static int l_open_image(lua_State *L)
+{
+    const char *filename = luaL_checkstring(L, 1);
+    Options opt;
+
+    _check_options(L, 2, &opt);
+    return _open_image(L, filename, &opt);
+}
+
+
+/* ---------------- stream enrichment --------------- */
+
+/* size of the input and output buffers of enrich */
+#define ENRICH_BUFSIZE (1 << 20)
+
+/**
+ * A Lua file handle or a plain file descriptor.
+ */
+typedef struct {
+    FILE *f;		/* NULL for a file descriptor */
+    int fd;
+} Stream;
+
+static void _check_stream(lua_State *L, int index, Stream *s)
+{
+    FILE **fp;
+
+    if (lua_type(L, index) == LUA_TNUMBER) {
+	s->f = NULL;
+	s->fd = lua_tointeger(L, index);
+	luaL_argcheck(L, s->fd >= 0, index, "invalid file descriptor");
+	return;
+    }
+
+    fp = (FILE**) luaL_checkudata(L, index, LUA_FILEHANDLE);
+    luaL_argcheck(L, *fp, index, "attempt to use a closed file");
+    s->f = *fp;
+    s->fd = -1;
+}
 
 /**
- * A GeoIP state has been created; now set up a userdata with metatable
- * to let Lua scripts access it.
+ * @return  The number of bytes read, 0 at the end of the file, or -1 on
+ *  errors.
+ */
+static ssize_t _stream_read(Stream *s, char *buf, size_t size)
+{
+    ssize_t n;
+
+    if (s->f) {
+	n = fread(buf, 1, size, s->f);
+	return n == 0 && ferror(s->f) ? -1 : n;
+    }
+
+    do
+	n = read(s->fd, buf, size);
+    while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/**
+ * @return  0 on success, or -1 on errors.
  */
-static int _open_common(lua_State *L, GeoIP *gi, const char *err_msg)
+static int _stream_write(Stream *s, const char *buf, size_t len)
 {
+    ssize_t n;
+
+    if (s->f)
+	return fwrite(buf, 1, len, s->f) == len ? 0 : -1;
+
+    while (len > 0) {
+	n = write(s->fd, buf, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * State of enrich.  The buffers are userdata on the Lua stack, so that they
+ * are freed when an error is raised.
+ */
+typedef struct {
     lua_geoip *lgi;
+    int column;		/* of the address, starting with 1 */
+    char sep;		/* column separator */
+    int n_fields;
+    Field **fields;
+    Stream out;
+    char *obuf;
+    size_t olen;
+} Enrich;
 
-    if (!gi)
-	return luaL_error(L, err_msg);
+static int _enrich_flush(Enrich *e)
+{
+    int rc = _stream_write(&e->out, e->obuf, e->olen);
+    e->olen = 0;
+    return rc;
+}
 
-    lgi = (lua_geoip*) lua_newuserdata(L, sizeof(*lgi));
-    lgi->gi = gi;
+static int _enrich_put(Enrich *e, const char *s, size_t len)
+{
+    if (e->olen + len > ENRICH_BUFSIZE && _enrich_flush(e))
+	return -1;
+    if (len > ENRICH_BUFSIZE)
+	return _stream_write(&e->out, s, len);
+    memcpy(e->obuf + e->olen, s, len);
+    e->olen += len;
+    return 0;
+}
 
-    if (luaL_newmetatable(L, GEOIP)) {
-	luaL_register(L, NULL, geoip_methods);
-	lua_pushvalue(L, -1);
-	lua_setfield(L, -2, "__index");
+/**
+ * Look up an address like _lookup_fields does, using the lookup cache for
+ * IPv4 addresses.
+ */
+static Result *_enrich_lookup(lua_State *L, Enrich *e, Addr *a, Result *gir)
+{
+    if (e->lgi->cache && !a->v6) {
+	_push_result_metatable(L);
+	if (!_push_lookup_ipnum(L, e->lgi, 1, a->ipnum, -1))
+	    return NULL;
+	return (Result*) lua_touserdata(L, -1);
     }
-    lua_setmetatable(L, -2);
 
+    memset(gir, 0, sizeof(*gir));
+    return _lookup_addr(e->lgi, a, gir) ? gir : NULL;
+}
+
+/**
+ * Find the address in the line, look it up and write the line with the
+ * fields appended.  Without an address, or if it is not found, the fields
+ * are left empty.
+ */
+static int _enrich_line(lua_State *L, Enrich *e, const char *line,
+    size_t len, size_t eol)
+{
+    const char *p = line, *end = line + len, *q;
+    char ip[INET6_ADDRSTRLEN], buf[TEXT_SIZE];
+    Result gir, *r = NULL;
+    int i, top = lua_gettop(L);
+    const char *text;
+    Addr a;
+
+    for (i=1; i<e->column && p; i++)
+	if ((p = memchr(p, e->sep, end - p)))
+	    p++;
+    if (p) {
+	q = memchr(p, e->sep, end - p);
+	if (!q)
+	    q = end;
+	if (q - p < sizeof(ip)) {
+	    memcpy(ip, p, q - p);
+	    ip[q - p] = 0;
+	    r = _parse_addr(ip, &a) ? _enrich_lookup(L, e, &a, &gir) : NULL;
+	}
+    }
+
+    if (_enrich_put(e, line, len))
+	goto error;
+    for (i=0; i<e->n_fields; i++) {
+	if (_enrich_put(e, &e->sep, 1))
+	    goto error;
+	if (r && (text = _field_text(r, e->fields[i], buf))
+	    && _enrich_put(e, text, strlen(text)))
+	    goto error;
+    }
+    if (_enrich_put(e, line + len, eol))
+	goto error;
+
+    if (r == &gir)
+	gir.meta->gc(L, &gir);
+    lua_settop(L, top);
+    return 0;
+
+error:
+    if (r == &gir)
+	gir.meta->gc(L, &gir);
+    lua_settop(L, top);
+    return -1;
+}
+
+
+/**
+ * Copy a log file line by line and append fields of the address found in
+ * each line, e.g.
+ *
+ *  geoip.enrich(g, io.stdin, io.stdout, { fields={ "country_code" } })
+ *
+ * Input and output are buffered in large chunks, and no Lua strings are
+ * created per line.  Addresses must be numeric; host names are not resolved.
+ *
+ * @param gi  GeoIP object
+ * @param in  Lua file handle or file descriptor to read from
+ * @param out  Lua file handle or file descriptor to write to
+ * @param options  Table with "fields", an array of field names to append;
+ *  "column", the column with the address (default 1); and "sep", the column
+ *  separator (default " "), which is also put before each field.
+ * @return  The number of lines.
+ */
+static int l_enrich(lua_State *L)
+{
+    ResultMeta *meta;
+    Result gir;
+    Stream in;
+    Enrich e;
+    char *ibuf, *line, *nl;
+    size_t isize = ENRICH_BUFSIZE, ilen = 0, len, eol;
+    ssize_t n;
+    lua_Number lines = 0;
+    int i, done = 0;
+
+    e.lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    _check_stream(L, 2, &in);
+    _check_stream(L, 3, &e.out);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    lua_settop(L, 4);
+    if (!(meta = _result_meta(e.lgi)))
+	return luaL_error(L, "unsupported database type");
+
+    lua_getfield(L, 4, "column");
+    e.column = luaL_optint(L, -1, 1);
+    luaL_argcheck(L, e.column >= 1, 4, "invalid column");
+    lua_getfield(L, 4, "sep");
+    e.sep = *luaL_optstring(L, -1, " ");
+    luaL_argcheck(L, e.sep && e.sep != '\n', 4, "invalid separator");
+    lua_pop(L, 2);
+
+    /* resolve the field names, like prepare */
+    lua_getfield(L, 4, "fields");
+    luaL_argcheck(L, lua_istable(L, -1), 4, "no fields given");
+    e.n_fields = lua_objlen(L, -1);
+    e.fields = (Field**) lua_newuserdata(L, (e.n_fields + 1) * sizeof(Field*));
+    gir.meta = meta;
+    _push_fields(L, &gir);
+    for (i=0; i<e.n_fields; i++) {
+	lua_rawgeti(L, 5, i + 1);
+	lua_rawget(L, -2);
+	if (!(e.fields[i] = (Field*) lua_touserdata(L, -1))) {
+	    lua_rawgeti(L, 5, i + 1);
+	    return luaL_error(L, "unknown field %s", lua_tostring(L, -1));
+	}
+	lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    e.obuf = (char*) lua_newuserdata(L, ENRICH_BUFSIZE);	/* 7 */
+    e.olen = 0;
+    ibuf = (char*) lua_newuserdata(L, isize);			/* 8 */
+
+    while (!done) {
+	/* make room for at least one more chunk; grow for long lines */
+	if (ilen == isize) {
+	    line = (char*) lua_newuserdata(L, isize * 2);
+	    memcpy(line, ibuf, ilen);
+	    lua_replace(L, 8);
+	    ibuf = line;
+	    isize *= 2;
+	}
+	if ((n = _stream_read(&in, ibuf + ilen, isize - ilen)) < 0)
+	    return luaL_error(L, "read error: %s", strerror(errno));
+	if (n == 0)
+	    done = 1;
+	ilen += n;
+
+	for (line=ibuf; line < ibuf + ilen; line=nl + 1) {
+	    nl = memchr(line, '\n', ibuf + ilen - line);
+	    if (!nl) {
+		if (!done)
+		    break;
+		nl = ibuf + ilen - 1;	/* last line without newline */
+		len = ibuf + ilen - line;
+		eol = 0;
+	    } else {
+		len = nl - line;
+		eol = 1;
+		if (len > 0 && line[len - 1] == '\r')
+		    len--, eol++;
+	    }
+	    if (_enrich_line(L, &e, line, len, eol))
+		return luaL_error(L, "write error: %s", strerror(errno));
+	    lines++;
+	}
+
+	ilen = ibuf + ilen - line;
+	memmove(ibuf, line, ilen);
+    }
+
+    if (_enrich_flush(&e))
+	return luaL_error(L, "write error: %s", strerror(errno));
+    lua_pushnumber(L, lines);
     return 1;
 }
 
 
+/* ---------------- GeoIP sets --------------- */
+
 /**
- * libGeoIP prints error messages (e.g. failure to open a data file) on stderr
- * instead of returning it somehow.  To avoid messy output, redirect stderr
- * to a pipe, which is read after the operation.
+ * A set of GeoIP objects that are queried together.  The results of all
+ * members are merged into one Result, whose data is an array with one Result
+ * per member.  The members are kept in the environment table of the set at
+ * the indices 1 to n, and the set itself at index 0; results of the set use
+ * the same environment table, so that the set lives as long as its results.
  */
 typedef struct {
-    int old_stderr;
-    int pipefd[2];
-    char buf[200];
-} Stderr;
+    int n;		/* number of members */
+    ResultMeta meta;	/* for the merged results, with all fields */
+    lua_geoip *members[1];	/* actually n entries */
+} lua_geoip_set;
+
+static lua_geoip_set *_set_of_result(Result *r)
+{
+    return (lua_geoip_set*) ((char*) r->meta - offsetof(lua_geoip_set, meta));
+}
+
+static int set_field_access(lua_State *L, Result *r, Field *f)
+{
+    Result *sub = (Result*) r->data + f->offset;
+    return sub->meta ? _access_field(L, sub, f->sub) : 0;
+}
+
+static const char *set_field_text(Result *r, Field *f, char *buf)
+{
+    Result *sub = (Result*) r->data + f->offset;
+    return sub->meta ? _field_text(sub, f->sub, buf) : NULL;
+}
 
-/* set up a pipe to catch stderr */
-static void stderr_init(Stderr *e)
+static int set_tostring(lua_State *L, Result *r)
 {
-    pipe(e->pipefd);
-    fcntl(e->pipefd[0], F_SETFL, O_NONBLOCK);
-    fcntl(e->pipefd[1], F_SETFL, O_NONBLOCK);
-    e->old_stderr = dup(2);
-    dup2(e->pipefd[1], 2);
+    lua_geoip_set *set = _set_of_result(r);
+    Result *sub = (Result*) r->data;
+    luaL_Buffer b;
+    int i, first = 1;
+
+    luaL_buffinit(L, &b);
+    for (i=0; i<set->n; i++, sub++) {
+	if (!sub->meta)
+	    continue;
+	if (!first)
+	    luaL_addstring(&b, "; ");
+	sub->meta->tostring(L, sub);
+	luaL_addvalue(&b);
+	first = 0;
+    }
+    luaL_pushresult(&b);
+    return 1;
 }
 
-/* read the error message(s) and restore the original stderr */
-static void stderr_done(Stderr *e)
+static void set_gc(lua_State *L, Result *r)
 {
-    int n = read(e->pipefd[0], e->buf, sizeof(e->buf));
-    if (n >= 0)
-	e->buf[n] = 0;
+    lua_geoip_set *set = _set_of_result(r);
+    Result *sub = (Result*) r->data;
+    int i;
 
-    close(e->pipefd[0]);
-    close(e->pipefd[1]);
-    dup2(e->old_stderr, 2);
+    if (!sub)
+	return;
+    for (i=0; i<set->n; i++)
+	if (sub[i].meta)
+	    sub[i].meta->gc(L, &sub[i]);
+    free(sub);
+    r->data = NULL;
 }
 
 
 /**
- * Open a GeoIP database file by specifying the desired type(s).  The default
- * file name for each type will be used.  The first successfully opened
- * database is used.  If none of the types are available, raise an error.
+ * Resolve a host name to an address of the given family (AF_INET or
+ * AF_INET6), so that the members of a set don't each have to do it.
+ */
+static int _resolve_addr(const char *name, int family, Addr *a)
+{
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    if (getaddrinfo(name, NULL, &hints, &res) || !res)
+	return 0;
+    if ((a->v6 = family == AF_INET6))
+	a->ip6 = ((struct sockaddr_in6*) res->ai_addr)->sin6_addr;
+    else
+	a->ipnum = ntohl(((struct sockaddr_in*) res->ai_addr)
+	    ->sin_addr.s_addr);
+    freeaddrinfo(res);
+    return 1;
+}
+
+static int _resolve_ipv4(const char *name, unsigned long *ipnum)
+{
+    Addr a;
+
+    if (!_resolve_addr(name, AF_INET, &a))
+	return 0;
+    *ipnum = a.ipnum;
+    return 1;
+}
+
+
+/**
+ * Look up a host name or IP address in all the databases of the set.  The
+ * address is parsed only once, and a name is resolved once per family:
+ * IPv6 members get its IPv6 address if it has one, else its IPv4 address,
+ * and IPv4 members get its IPv4 address.
  *
- * @param type...  The database type(s) to open.
- * @return  A GeoIP object or nil on error.
+ * @param set  GeoIP set
+ * @param name  Host name or IP address to look up
+ * @return  A Result object with the fields of all databases, or nil if
+ *  nothing was found in any of them.
  */
-static int l_open_type(lua_State *L)
+static int l_set_lookup(lua_State *L)
 {
-    Stderr e;
-    int i;
-    GeoIPDBTypes type;
-    GeoIP *gi = NULL;
+    lua_geoip_set *set = (lua_geoip_set*) luaL_checkudata(L, 1, GEOIPSET);
+    const char *hostname = luaL_checkstring(L, 2);
+    Result gir, *sub;
+    int i, found = 0, has4 = 1, has6 = 0;
+    Addr a, a6;
 
-    stderr_init(&e);
+    if (_parse_addr(hostname, &a))
+	a6 = a;
+    else {
+	has4 = _resolve_addr(hostname, AF_INET, &a);
+	for (i=0; i<set->n && !_is_v6(set->members[i]); i++)
+	    ;
+	if (i < set->n)
+	    has6 = _resolve_addr(hostname, AF_INET6, &a6);
+	if (!has6)
+	    a6 = a;
+	if (!has4 && !has6)
+	    return 0;
+    }
 
-    for (i = 1; i<=lua_gettop(L); i++) {
-	const char *type_name = luaL_checkstring(L, i);
+    if (!(sub = (Result*) calloc(set->n, sizeof(*sub))))
+	return luaL_error(L, "out of memory");
+    for (i=0; i<set->n; i++) {
+	if (_is_v6(set->members[i]))
+	    found += _lookup_addr(set->members[i], &a6, &sub[i]);
+	else if (has4)
+	    found += _lookup_addr(set->members[i], &a, &sub[i]);
+    }
+    if (!found) {
+	free(sub);
+	return 0;
+    }
 
-	if (!strcmp(type_name, "city"))
-	    type = GEOIP_CITY_EDITION_REV1;
-	else if (!strcmp(type_name, "country"))
-	    type = GEOIP_COUNTRY_EDITION;
-	else if (!strcmp(type_name, "region"))
-	    type = GEOIP_REGION_EDITION_REV1;
-	else
-	    return luaL_error(L, "invalid type (city, country or region)");
+    memset(&gir, 0, sizeof(gir));
+    gir.meta = &set->meta;
+    gir.data = (void*) sub;
+    _push_result_metatable(L);
+    _push_result(L, &gir, -1);
+    lua_getfenv(L, 1);
+    lua_setfenv(L, -2);
+    return 1;
+}
 
-	if ((gi = GeoIP_open_type(type, GEOIP_INDEX_CACHE)))
-	    break;
+
+static int l_set_tostring(lua_State *L)
+{
+    lua_geoip_set *set = (lua_geoip_set*) luaL_checkudata(L, 1, GEOIPSET);
+    lua_pushfstring(L, "GeoIP set of %d databases", set->n);
+    return 1;
+}
+
+
+/**
+ * Free the merged field list.  The members are GeoIP objects that are
+ * collected on their own.
+ */
+static int l_set_gc(lua_State *L)
+{
+    lua_geoip_set *set = (lua_geoip_set*) luaL_checkudata(L, 1, GEOIPSET);
+    Field *f;
+
+    if (set->meta.fields) {
+	lua_pushlightuserdata(L, &set->meta);
+	lua_pushnil(L);
+	lua_rawset(L, LUA_ENVIRONINDEX);
+	for (f=set->meta.fields; f->name; f++)
+	    free((char*) f->name);
+	free(set->meta.fields);
+	set->meta.fields = NULL;
     }
+    return 0;
+}
 
-    stderr_done(&e);
-    return _open_common(L, gi, e.buf);
+static const luaL_Reg set_methods[] = {
+    { "__tostring", l_set_tostring },
+    { "__gc", l_set_gc },
+    { "lookup", l_set_lookup },
+    { NULL, NULL }
+};
+
+static int _compare_names(const void *a, const void *b)
+{
+    return strcmp(* (const char**) a, * (const char**) b);
 }
 
 
 /**
- * Open a GeoIP database file.
+ * Build the merged field list of a set.  Member fields keep their names,
+ * unless an earlier member already has a field with that name; then the
+ * name of the member and "_" is put in front, e.g. "isp_name".
+ */
+static void _set_fields(lua_State *L, lua_geoip_set *set, const char **keys)
+{
+    int i, n = 0;
+    Field *f, *g, *out;
+    ResultMeta *meta;
+    const char *name;
+
+    for (i=0; i<set->n; i++)
+	n += _result_meta(set->members[i])->n_fields;
+
+    if (!(out = (Field*) calloc(n + 1, sizeof(*out))))
+	luaL_error(L, "out of memory");
+    set->meta.fields = out;
+
+    for (i=0; i<set->n; i++) {
+	meta = _result_meta(set->members[i]);
+	for (f=meta->fields; f->name; f++) {
+	    for (g=set->meta.fields; g < out && strcmp(g->name, f->name); g++)
+		;
+	    if (g < out) {
+		name = lua_pushfstring(L, "%s_%s", keys[i], f->name);
+		out->name = strdup(name);
+		lua_pop(L, 1);
+	    } else
+		out->name = strdup(f->name);
+	    if (!out->name)
+		luaL_error(L, "out of memory");
+	    out->mode = 3;
+	    out->offset = i;
+	    out->callback = set_field_access;
+	    out->text = set_field_text;
+	    out->sub = f;
+	    out++;
+	}
+    }
+
+    set->meta.gc = set_gc;
+    set->meta.tostring = set_tostring;
+    _register_fields(L, &set->meta);
+}
+
+
+/**
+ * Open several database files that are queried together, e.g.
  *
- * @param fname  Name of the file to open (including path)
- * @return  A GeoIP object or nil on error.
+ *  s = geoip.open_set{ city="GeoLiteCity.dat", asn="GeoIPASNum.dat" }
+ *  r = s:lookup("74.125.67.100")
+ *  print(r.city, r.asn)
+ *
+ * The members are ordered by their names, which are used as prefix for
+ * field names that occur in more than one database.
+ *
+ * @param files  Table with member names as keys and file names as values
+ * @param options  (optional) Table with options for all members, see
+ *  _check_options; the lookup cache is not used for sets.
+ * @return  A GeoIP set.
  */
-static int l_open(lua_State *L)
+static int l_open_set(lua_State *L)
 {
-    const char *filename = luaL_checkstring(L, 1);
-    Stderr e;
+    const char **keys;
+    lua_geoip_set *set;
+    lua_geoip *lgi;
+    Options opt, member;
     GeoIP *gi;
+    int i, n = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    _check_options(L, 2, &opt);
+    opt.cache_entries = 0;
+
+    /* collect the names of the members; the strings stay in the table. */
+    lua_pushnil(L);
+    while (lua_next(L, 1)) {
+	if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING)
+	    return luaL_error(L, "open_set expects names and file names");
+	lua_pop(L, 1);
+	n++;
+    }
+    luaL_argcheck(L, n > 0, 1, "no databases given");
+
+    keys = (const char**) lua_newuserdata(L, n * sizeof(*keys));
+    lua_pushnil(L);
+    for (i=0; lua_next(L, 1); i++) {
+	keys[i] = lua_tostring(L, -2);
+	lua_pop(L, 1);
+    }
+    qsort(keys, n, sizeof(*keys), _compare_names);
+
+    set = (lua_geoip_set*) lua_newuserdata(L, sizeof(*set)
+	+ (n - 1) * sizeof(lua_geoip*));
+    memset(set, 0, sizeof(*set));
+    if (luaL_newmetatable(L, GEOIPSET)) {
+	luaL_register(L, NULL, set_methods);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, n, 1);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 0);
+    lua_pushvalue(L, -1);
+    lua_setfenv(L, -3);
+
+    for (i=0; i<n; i++) {
+	lua_getfield(L, 1, keys[i]);
+	gi = _open_file(L, lua_tostring(L, -1), opt.flags);
+	/* index="flat" applies to the country members only */
+	member = opt;
+	member.flat = opt.flat && gi
+	    && gi->databaseType == GEOIP_COUNTRY_EDITION;
+	_open_common(L, gi, lua_tostring(L, -1), &member);
+	lua_remove(L, -2);
+	lgi = (lua_geoip*) lua_touserdata(L, -1);
+	if (!_result_meta(lgi))
+	    return luaL_error(L, "unsupported database type for %s", keys[i]);
+	lua_rawseti(L, -2, i + 1);
+	set->members[set->n++] = lgi;
+    }
+    lua_pop(L, 1);
+
+    _set_fields(L, set, keys);
+    return 1;
+}
+
+
+/* ---------------- country ids --------------- */
+
+/* push string k of the country id given as first argument */
+static int _push_country(lua_State *L, int k)
+{
+    int id = luaL_checkint(L, 1);
+
+    if (id < 0)
+	return 0;
+    lua_rawgeti(L, LUA_ENVIRONINDEX, 3 * id + k + 1);
+    return lua_isnil(L, -1) ? 0 : 1;
+}
 
-    stderr_init(&e);
-    gi = GeoIP_open(filename, GEOIP_INDEX_CACHE);
-    stderr_done(&e);
-    return _open_common(L, gi, e.buf);
+/**
+ * Convert a country id, as returned by the id method, to the country name,
+ * the two letter code or the continent code.
+ *
+ * @param id  Country id
+ * @return  The string, or nil for an invalid id.
+ */
+static int l_country_name(lua_State *L)
+{
+    return _push_country(L, 0);
+}
+
+static int l_country_code(lua_State *L)
+{
+    return _push_country(L, 1);
+}
+
+static int l_country_continent(lua_State *L)
+{
+    return _push_country(L, 2);
+}
+
+
+/* ---------------- FFI interface --------------- */
+
+/*
+ * These functions are exported for the LuaJIT FFI, see geoip_ffi.lua.  With
+ * them, a lookup doesn't cross a lua_CFunction, which would end a trace.
+ * The result struct given by the caller has the layout of Result; it is
+ * initially zeroed and must be freed with geoip_ffi_free.  Fields are given
+ * by their index in the field list of the database type.
+ */
+
+#define GEOIP_FFI_VERSION 1
+
+int geoip_ffi_version(void)
+{
+    return GEOIP_FFI_VERSION;
+}
+
+/**
+ * Return the handle of a GeoIP object for the other FFI functions.  It is
+ * valid while the object is alive.
+ *
+ * @param gi  GeoIP object
+ * @return  The handle as light userdata.
+ */
+static int l_ffi_handle(lua_State *L)
+{
+    lua_geoip *lgi = (lua_geoip*) luaL_checkudata(L, 1, GEOIP);
+    luaL_argcheck(L, _result_meta(lgi), 1, "unsupported database type");
+    lua_pushlightuserdata(L, lgi);
+    return 1;
+}
+
+/**
+ * @return  The index of the field with this name, or -1.
+ */
+int geoip_ffi_field_index(void *handle, const char *name)
+{
+    ResultMeta *meta = _result_meta((lua_geoip*) handle);
+    int i;
+
+    for (i=0; i<meta->n_fields; i++)
+	if (!strcmp(meta->fields[i].name, name))
+	    return i;
+    return -1;
+}
+
+void geoip_ffi_free(Result *r)
+{
+    if (r->meta)
+	r->meta->gc(NULL, r);
+    r->meta = NULL;
+    r->data = NULL;
+}
+
+/**
+ * Look up an IPv4 address given as number into the result r, whose previous
+ * content is freed first.
+ *
+ * @return  1 on success, 0 if nothing was found.
+ */
+int geoip_ffi_lookup_ipnum(void *handle, unsigned int ipnum, Result *r)
+{
+    geoip_ffi_free(r);
+    r->cached = 0;
+    return _lookup_ipnum((lua_geoip*) handle, ipnum, r);
+}
+
+/**
+ * Like geoip_ffi_lookup_ipnum, for an IPv4 or IPv6 address as string.  Host
+ * names are not resolved.
+ */
+int geoip_ffi_lookup_addr(void *handle, const char *addr, Result *r)
+{
+    Addr a;
+
+    geoip_ffi_free(r);
+    r->cached = 0;
+    return _parse_addr(addr, &a) && _lookup_addr((lua_geoip*) handle, &a, r);
+}
+
+/**
+ * @param buf  Buffer of 32 bytes for numbers
+ * @return  The value of the field as string, or NULL if not set.
+ */
+const char *geoip_ffi_text(Result *r, int field, char *buf)
+{
+    if (!r->meta || field < 0 || field >= r->meta->n_fields)
+	return NULL;
+    return _field_text(r, &r->meta->fields[field], buf);
+}
+
+/**
+ * @return  The value of the field as number, or NaN if it is not set or not
+ *  a number.
+ */
+double geoip_ffi_number(Result *r, int field)
+{
+    char buf[TEXT_SIZE], *end;
+    const char *s;
+    double d;
+
+    if (!r->meta || field < 0 || field >= r->meta->n_fields)
+	return NAN;
+    if (r->meta->fields[field].mode == 2)
+	return * (float*) ((char*) r->data + r->meta->fields[field].offset);
+    if (!(s = _field_text(r, &r->meta->fields[field], buf)))
+	return NAN;
+    d = strtod(s, &end);
+    return *s && !*end ? d : NAN;
 }
 
 
 static const luaL_Reg globals[] = {
     { "open_type", l_open_type },
     { "open", l_open },
+    { "open_set", l_open_set },
+    { "open_image", l_open_image },
+    { "enrich", l_enrich },
+    { "country_name", l_country_name },
+    { "country_code", l_country_code },
+    { "country_continent", l_country_continent },
+    { "ffi_handle", l_ffi_handle },
+    { "set_resolver", l_set_resolver },
+    { "stats", l_stats },
+#ifdef HAVE_GETADDRINFO_A
+    { "poll", l_poll },
+#endif
     { NULL, NULL },
 };
 
 
 /**
  * Initialize this module.  Note that it doesn't automatically create a
- * global table.
+ * global table.  The functions share an environment table that holds the
+ * field tables of the result types.
  *
  * @return  A table with this module.
  */
 int luaopen_geoip(lua_State *L)
 {
+    ResultMeta **meta;
+
+    /* private environment shared by all functions of this module */
+    lua_newtable(L);
+    lua_replace(L, LUA_ENVIRONINDEX);
+    for (meta=result_metas; *meta; meta++)
+	_register_fields(L, *meta);
+    _register_countries(L);
+    lua_pushlightuserdata(L, &formats_key);
+    lua_newtable(L);
+    lua_rawset(L, LUA_ENVIRONINDEX);
+    _pool_register(L);
+
     lua_newtable(L);
     luaL_register(L, NULL, globals);
     return 1;
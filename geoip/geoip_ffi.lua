@@ -0,0 +1,78 @@
+-- vim:sw=4:sts=4
+--
+-- Lookups through the LuaJIT FFI, which can be compiled into traces.  Load
+-- this module as "geoip.ffi" after opening a database with the geoip module:
+--
+--  gffi = require "geoip.ffi"
+--  h = gffi.wrap(geoip.open_type("city", { cache="memory" }))
+--  r = h:result()
+--  if h:lookup_ipnum(1249592164, r) then print(h:text(r, "city")) end
+
+local ffi = require "ffi"
+local geoip = require "geoip"
+
+ffi.cdef[[
+typedef struct { const void *meta; void *data; int cached; } geoip_result;
+int geoip_ffi_version(void);
+int geoip_ffi_field_index(void *handle, const char *name);
+void geoip_ffi_free(geoip_result *r);
+int geoip_ffi_lookup_ipnum(void *handle, unsigned int ipnum, geoip_result *r);
+int geoip_ffi_lookup_addr(void *handle, const char *addr, geoip_result *r);
+const char *geoip_ffi_text(geoip_result *r, int field, char *buf);
+double geoip_ffi_number(geoip_result *r, int field);
+]]
+
+-- the library is already loaded by require "geoip"; this gets its symbols
+local C = ffi.load(assert(package.searchpath("geoip", package.cpath),
+    "geoip.so not found"))
+assert(C.geoip_ffi_version() == 1, "geoip.so has another FFI version")
+
+local result_t = ffi.typeof("geoip_result")
+local buf = ffi.new("char[32]")
+
+local Handle = {}
+Handle.__index = Handle
+
+-- Wrap a GeoIP object.  It is kept by the wrapper, so the handle stays valid.
+local function wrap(g)
+    return setmetatable({ g=g, ptr=geoip.ffi_handle(g), fields={} }, Handle)
+end
+
+-- Index of a field by name; looked up once per name.
+function Handle:field(name)
+    local i = self.fields[name]
+    if not i then
+	i = C.geoip_ffi_field_index(self.ptr, name)
+	if i < 0 then error("unknown field " .. name, 2) end
+	self.fields[name] = i
+    end
+    return i
+end
+
+-- A new result struct, freed by the garbage collector.
+function Handle:result()
+    return ffi.gc(result_t(), C.geoip_ffi_free)
+end
+
+function Handle:lookup_ipnum(ipnum, r)
+    return C.geoip_ffi_lookup_ipnum(self.ptr, ipnum, r) ~= 0
+end
+
+-- IPv4 or IPv6 address as string; host names are not resolved.
+function Handle:lookup_addr(addr, r)
+    return C.geoip_ffi_lookup_addr(self.ptr, addr, r) ~= 0
+end
+
+-- The value of a field as string, or nil.
+function Handle:text(r, name)
+    local s = C.geoip_ffi_text(r, self:field(name), buf)
+    if s ~= nil then return ffi.string(s) end
+end
+
+-- The value of a field as number, or nil.
+function Handle:number(r, name)
+    local d = C.geoip_ffi_number(r, self:field(name))
+    if d == d then return d end
+end
+
+return { wrap=wrap, C=C }
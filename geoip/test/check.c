@@ -0,0 +1,121 @@
+/** vim:sw=4:sts=4
+ *
+ * Driver of the checks: a Lua interpreter with the geoip module linked in,
+ * and an allocator that counts how often it is asked for memory.
+ *
+ *  check script.lua [args...]
+ *
+ * The script gets its arguments in arg like with lua(1), loads the module
+ * with require "geoip", and finds modules next to it.  The table "check"
+ * has these functions:
+ *
+ *  check.allocations()  number of allocations so far
+ *  check.clock()  monotonic time in seconds, with nanosecond resolution
+ *
+ * The exit status is 1 if the script raises an error.
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int luaopen_geoip(lua_State *L);
+
+static unsigned long allocations;
+
+/*
+ * The lua_Alloc of the state.  New blocks and blocks that grow count as
+ * allocations; shrinking and freeing don't.
+ */
+static void *_counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    if (!nsize) {
+	free(ptr);
+	return NULL;
+    }
+    if (!ptr || nsize > osize)
+	allocations++;
+    return realloc(ptr, nsize);
+}
+
+static int _panic(lua_State *L)
+{
+    fprintf(stderr, "PANIC: %s\n", lua_tostring(L, -1));
+    return 0;
+}
+
+static int l_allocations(lua_State *L)
+{
+    lua_pushnumber(L, allocations);
+    return 1;
+}
+
+static int l_clock(lua_State *L)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    lua_pushnumber(L, ts.tv_sec + ts.tv_nsec * 1e-9);
+    return 1;
+}
+
+static const luaL_Reg check_functions[] = {
+    { "allocations", l_allocations },
+    { "clock", l_clock },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+    const char *slash;
+    lua_State *L;
+    int i, rc;
+
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s script.lua [args...]\n", argv[0]);
+	return 2;
+    }
+    if (!(L = lua_newstate(_counting_alloc, NULL))) {
+	fprintf(stderr, "%s: cannot create the Lua state\n", argv[0]);
+	return 1;
+    }
+    lua_atpanic(L, _panic);
+    luaL_openlibs(L);
+
+    /* require "geoip" gets the linked module, and finds the script's
+     * modules first */
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "preload");
+    lua_pushcfunction(L, luaopen_geoip);
+    lua_setfield(L, -2, "geoip");
+    lua_pop(L, 1);
+    slash = strrchr(argv[1], '/');
+    if (slash)
+	lua_pushlstring(L, argv[1], slash - argv[1]);
+    else
+	lua_pushliteral(L, ".");
+    lua_pushliteral(L, "/?.lua;");
+    lua_getfield(L, -3, "path");
+    lua_concat(L, 3);
+    lua_setfield(L, -2, "path");
+    lua_pop(L, 1);
+
+    luaL_register(L, "check", check_functions);
+    lua_pop(L, 1);
+
+    lua_createtable(L, argc - 2, 2);
+    for (i=0; i<argc; i++) {
+	lua_pushstring(L, argv[i]);
+	lua_rawseti(L, -2, i - 1);
+    }
+    lua_setglobal(L, "arg");
+
+    if ((rc = luaL_dofile(L, argv[1])))
+	fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,253 @@
+-- vim:sw=4:sts=4
+--
+-- Checks of the lookup functions against the fixture database, run by
+-- "make check" with the driver in check.c:
+--
+--  test/check test/check.lua
+--
+-- Every lookup function is run for each address of the fixture and for each
+-- way to open it, and the results are compared with the expected ones.  The
+-- functions that are meant to look up without creating objects are checked
+-- to make no allocations.  Prints the failures and raises an error if there
+-- were any.
+
+geoip = require "geoip"
+local fixture = require "fixture"
+
+local failures, checks = 0, 0
+
+local function expect(got, want, what)
+    checks = checks + 1
+    if got ~= want then
+	failures = failures + 1
+	print(string.format("FAIL %s: got %s, expected %s", what,
+	    tostring(got), tostring(want)))
+    end
+end
+
+-- the country code of a result, or false
+local function code(r)
+    return r and r.country_code or false
+end
+
+-- expected country code and continent of an address of the fixture
+local function wanted(a)
+    local net = a[2] and fixture.networks[a[2]]
+    if not net then return false end
+    return net[4], net[5]
+end
+
+local path = fixture.write(os.tmpname())
+local image = os.tmpname()
+local ips, sorted = {}, {}
+for i, a in ipairs(fixture.addresses) do
+    ips[i] = a[1]
+    sorted[i] = a[1]
+end
+table.sort(sorted, function(x, y)
+    return fixture.ipnum(x) < fixture.ipnum(y)
+end)
+
+-- a Result to give to lookup_into, from an object without a lookup cache
+local base = geoip.open(path, { cache="memory" })
+local into = assert(base:lookup("1.2.3.4"), "fixture not readable")
+
+-- allocations per run of f over all addresses of the fixture
+local function allocations(f)
+    f()
+    local n0 = check.allocations()
+    for i = 1, 10 do f() end
+    return (check.allocations() - n0) / 10 / #fixture.addresses
+end
+
+-- cached: whether g has a lookup cache, whose misses create results
+local function check_lookups(name, g, cached)
+    local q = g:prepare{ "country_code", "continent" }
+
+    for _, a in ipairs(fixture.addresses) do
+	local ip, want, continent = a[1], wanted(a)
+	local what = name .. " " .. ip
+
+	local r = g:lookup(ip)
+	expect(code(r), want, what .. " lookup")
+	if r and want then
+	    expect(r.continent, continent, what .. " continent")
+	    expect(r.country, geoip.country_name(fixture.networks[a[2]][3]),
+		what .. " country")
+	    expect(tostring(r), r.country .. " (" .. want .. ")",
+		what .. " tostring")
+	    local fields = {}
+	    for k, v in r do fields[k] = v end
+	    expect(fields.country_code, want, what .. " iteration")
+	end
+
+	expect(code(g:lookup_addr(ip)), want, what .. " lookup_addr")
+	expect(code(g:lookup_ipnum(fixture.ipnum(ip))), want,
+	    what .. " lookup_ipnum")
+	expect(code(g:lookup_table(ip)), want, what .. " lookup_table")
+
+	local cc, cont = q(ip)
+	expect(cc or false, want, what .. " prepare")
+	expect(cont or false, continent or false, what .. " prepare continent")
+
+	expect(g:format(ip, "%country_code%/%continent%") or false,
+	    want and want .. "/" .. continent, what .. " format")
+
+	r = g:lookup_into(into, ip)
+	expect(r and r == into and into.country_code or false, want,
+	    what .. " lookup_into")
+
+	local id, first, last = g:id(ip)
+	if want then
+	    local net = fixture.networks[a[2]]
+	    local f, l = fixture.range(a[2])
+	    expect(id, net[3], what .. " id")
+	    expect(geoip.country_code(id), want, what .. " country_code")
+	    expect(first, f, what .. " first")
+	    expect(last, l, what .. " last")
+	else
+	    expect(id, 0, what .. " id")
+	end
+    end
+
+    local function check_array(api, rs, list)
+	for i, ip in ipairs(list) do
+	    local a
+	    for _, b in ipairs(fixture.addresses) do
+		if b[1] == ip then a = b end
+	    end
+	    expect(code(rs[i]), wanted(a), name .. " " .. ip .. " " .. api)
+	end
+    end
+    check_array("lookup_many", g:lookup_many(ips), ips)
+    check_array("lookup_many sorted", g:lookup_many(ips, { sorted=true }),
+	ips)
+    check_array("lookup_sorted", g:lookup_sorted(sorted), sorted)
+
+    -- the functions that don't create result objects
+    if cached then return end
+    local ipnums = {}
+    for i, ip in ipairs(ips) do ipnums[i] = fixture.ipnum(ip) end
+    expect(allocations(function()
+	for i = 1, #ips do g:id(ipnums[i]) end
+    end), 0, name .. " allocations of id")
+    expect(allocations(function()
+	for i = 1, #ips do q(ips[i]) end
+    end), 0, name .. " allocations of prepare")
+    expect(allocations(function()
+	for i = 1, #ips do g:lookup_into(into, ips[i]) end
+    end), 0, name .. " allocations of lookup_into")
+end
+
+-- lookup_many with threads, on enough addresses for several chunks
+local function check_threads(name, g)
+    local many = {}
+    for i = 1, 2000 do many[i] = ips[(i - 1) % #ips + 1] end
+    local rs = g:lookup_many(many, { threads=4 })
+    for i = 1, #many do
+	local a = fixture.addresses[(i - 1) % #ips + 1]
+	expect(code(rs[i]), wanted(a), name .. " " .. a[1] .. " threads")
+    end
+end
+
+local function check_enrich(name, g)
+    local input, output = os.tmpname(), os.tmpname()
+    local f = assert(io.open(input, "w"))
+    for _, ip in ipairs(ips) do f:write(ip, " x\n") end
+    f:close()
+
+    local fin, fout = assert(io.open(input)), assert(io.open(output, "w"))
+    expect(geoip.enrich(g, fin, fout, { fields={ "country_code" } }), #ips,
+	name .. " enrich lines")
+    fin:close()
+    fout:close()
+
+    local i = 0
+    for line in io.lines(output) do
+	i = i + 1
+	local a = fixture.addresses[i]
+	expect(line, a[1] .. " x " .. (wanted(a) or ""), name .. " enrich")
+    end
+    expect(i, #ips, name .. " enrich output")
+    os.remove(input)
+    os.remove(output)
+end
+
+local modes = {
+    { "standard", { cache="standard" } },
+    { "memory", { cache="memory" } },
+    { "mmap", { cache="mmap" } },
+    { "cache", { cache="memory", cache_entries=8 } },
+    { "flat", { cache="memory", index="flat" } },
+}
+
+for _, mode in ipairs(modes) do
+    local name, opt = mode[1], mode[2]
+    local g = geoip.open(path, opt)
+    check_lookups(name, g, opt.cache_entries)
+    expect(g:stats().lookups > 0, true, name .. " stats")
+    check_enrich(name, g)
+    if opt.cache ~= "standard" then
+	check_threads(name, g)
+    end
+    if opt.cache_entries then
+	-- lookup_into refuses the results of the cache
+	g:lookup("1.2.3.4")
+	expect(g:cache_stats().hits > 0, true, name .. " cache_stats")
+	expect(pcall(g.lookup_into, g, g:lookup("1.2.3.4"), "1.2.3.4"), false,
+	    name .. " lookup_into with a cached result")
+    end
+    if opt.index then
+	expect(g:compile(), fixture.ranges, name .. " compile")
+	expect(g:save_image(image), true, name .. " save_image")
+    end
+end
+
+-- the image written above, and a copy with one byte of the data changed
+local gi = geoip.open_image(image)
+check_lookups("image", gi)
+check_enrich("image", gi)
+check_threads("image", gi)
+expect(gi:verify_image(), true, "image verify_image")
+local corrupt = os.tmpname()
+local f = assert(io.open(image, "rb"))
+local data = f:read("*a")
+f:close()
+f = assert(io.open(corrupt, "wb"))
+f:write(data:sub(1, -2), string.char((data:byte(-1) + 1) % 256))
+f:close()
+expect(gi:reload(corrupt), gi, "image reload")
+expect(gi:verify_image(), nil, "image verify_image of a corrupt copy")
+
+local s = geoip.open_set({ country=path }, { cache="memory", index="flat" })
+for _, a in ipairs(fixture.addresses) do
+    expect(code(s:lookup(a[1])), wanted(a), "set " .. a[1])
+end
+
+-- reload_async keeps the old database in use until reload_poll swaps
+local g = geoip.open(path, { cache="memory", index="flat" })
+expect(g:reload_async(), true, "reload_async")
+local done
+repeat done = g:reload_poll() until done ~= false
+expect(done, true, "reload_poll")
+expect(g:info().reloads, 1, "reload_async reloads")
+expect(code(g:lookup("1.2.3.4")), "AD", "lookup after reload_async")
+g:reload_async(path .. ".missing")
+repeat done = g:reload_poll() until done ~= false
+expect(done, nil, "reload_poll of a missing file")
+
+local st = geoip.stats()
+expect(st.results_created >= st.results_freed, true, "geoip.stats")
+
+expect(pcall(geoip.open, path, { index="flat", check=true }), false,
+    "flat index with check")
+expect(geoip.open(path, { cache="standard" }):compile(), fixture.ranges,
+    "compile")
+
+os.remove(path)
+os.remove(image)
+os.remove(corrupt)
+print(string.format("%d checks, %d failures", checks, failures))
+if failures > 0 then
+    error("the checks failed", 0)
+end
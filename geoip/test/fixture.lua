@@ -0,0 +1,109 @@
+-- vim:sw=4:sts=4
+--
+-- A small IPv4 country database for the checks.  The file is written like
+-- libGeoIP expects it: a binary tree of nodes with two 3 byte records each
+-- (little endian), where a record of COUNTRY_BEGIN + id is a leaf with the
+-- country id, followed by the structure info (three bytes 255 and the
+-- database type).  Addresses outside the networks have id 0, i.e. unknown.
+
+local COUNTRY_BEGIN = 16776960
+local GEOIP_COUNTRY_EDITION = 1
+
+local M = {}
+
+-- address, prefix length, country id, country code, continent; the
+-- networks must not overlap, and neighbours have different ids.
+M.networks = {
+    { "1.0.0.0", 8, 3, "AD", "EU" },
+    { "10.1.0.0", 16, 4, "AE", "AS" },
+    { "10.2.3.0", 24, 5, "AF", "AS" },
+    { "192.168.1.128", 25, 6, "AG", "NA" },
+    { "200.0.0.0", 7, 8, "AL", "EU" },
+    { "255.255.255.255", 32, 9, "AM", "AS" },
+}
+
+-- the number of ranges of the flat index: the networks and the gaps
+M.ranges = 12
+
+-- addresses in and next to the networks, with the index of the network
+-- they belong to, or false
+M.addresses = {
+    { "0.0.0.0", false },
+    { "0.255.255.255", false },
+    { "1.0.0.0", 1 },
+    { "1.2.3.4", 1 },
+    { "1.255.255.255", 1 },
+    { "2.0.0.0", false },
+    { "10.0.255.255", false },
+    { "10.1.0.0", 2 },
+    { "10.1.200.1", 2 },
+    { "10.2.2.255", false },
+    { "10.2.3.0", 3 },
+    { "10.2.3.255", 3 },
+    { "10.2.4.0", false },
+    { "192.168.1.127", false },
+    { "192.168.1.128", 4 },
+    { "192.168.1.255", 4 },
+    { "199.255.255.255", false },
+    { "200.0.0.0", 5 },
+    { "201.1.1.1", 5 },
+    { "202.0.0.0", false },
+    { "255.255.255.254", false },
+    { "255.255.255.255", 6 },
+}
+
+-- a dotted quad as number
+function M.ipnum(addr)
+    local a, b, c, d = addr:match("^(%d+)%.(%d+)%.(%d+)%.(%d+)$")
+    return ((a * 256 + b) * 256 + c) * 256 + d
+end
+
+-- first and last address of network k
+function M.range(k)
+    local net = M.networks[k]
+    local size = 2 ^ (32 - net[2])
+    local first = M.ipnum(net[1])
+    return first, first + size - 1
+end
+
+local function record(v)
+    return string.char(v % 256, math.floor(v / 256) % 256,
+	math.floor(v / 65536))
+end
+
+-- write the database to path, which is returned
+function M.write(path)
+    local nodes, n = { [0] = { COUNTRY_BEGIN, COUNTRY_BEGIN } }, 1
+
+    for _, net in ipairs(M.networks) do
+	local ipnum, len, node = M.ipnum(net[1]), net[2], 0
+	for depth = 31, 32 - len, -1 do
+	    local bit = math.floor(ipnum / 2 ^ depth) % 2 + 1
+	    if depth == 32 - len then
+		nodes[node][bit] = COUNTRY_BEGIN + net[3]
+	    else
+		-- split a leaf into a node whose subtrees are that leaf
+		local leaf = nodes[node][bit]
+		if leaf >= COUNTRY_BEGIN then
+		    nodes[n] = { leaf, leaf }
+		    nodes[node][bit] = n
+		    n = n + 1
+		end
+		node = nodes[node][bit]
+	    end
+	end
+    end
+
+    local out = {}
+    for i = 0, n - 1 do
+	out[#out + 1] = record(nodes[i][1]) .. record(nodes[i][2])
+    end
+    out[#out + 1] = "\255\255\255" .. string.char(GEOIP_COUNTRY_EDITION)
+
+    local f = assert(io.open(path, "wb"))
+    f:write(table.concat(out))
+    f:close()
+    return path
+end
+
+return M
@@ -0,0 +1,38 @@
+-- vim:sw=4:sts=4
+--
+-- Allocations per lookup that test/perf.lua allows for each function, in
+-- every cache mode.  They follow from the objects that the functions
+-- create for the addresses of test/fixture.lua, so they don't depend on the
+-- machine; change them only together with the code they describe.
+
+-- share of the fixture's addresses that are in a network, i.e. found
+local found = 12 / 22
+
+-- addresses per call of lookup_many and lookup_sorted (BATCH in perf.lua)
+local batch = 1000
+
+-- networks of the fixture; a sorted batch finds each once
+local networks = 6
+
+return {
+    -- a Result per address found
+    lookup = found,
+    lookup_ipnum = found,
+
+    -- nothing: the output exists already (the country codes are strings of
+    -- the fixture module)
+    lookup_into = 0,
+    prepare = 0,
+    format = 0,
+    id = 0,
+
+    -- a Result per address found, and the array with its part for entries
+    lookup_many = found + 2 / batch,
+
+    -- a Result per network instead
+    lookup_sorted = (networks + 2) / batch,
+
+    -- plus the options table with its hash part, and the userdata for the
+    -- workers' results
+    threads = found + 5 / batch,
+}
@@ -0,0 +1,181 @@
+-- vim:sw=4:sts=4
+--
+-- Time and allocations per lookup of the lookup functions on the fixture
+-- database, compared with baselines.  Run by "make perf" with the driver in
+-- check.c:
+--
+--  test/check test/perf.lua allocs.lua [times.lua]  compare
+--  test/check test/perf.lua -w allocs.lua times.lua  record the times
+--
+-- allocs.lua (test/perf-baseline.lua) is part of the source and holds the
+-- allocations per lookup allowed for each function; a scenario fails if it
+-- makes more.  Times depend on the machine, so times.lua is recorded
+-- locally ("make perf-baseline"), and a scenario fails if it got slower
+-- than recorded by more than TOLERANCE.  Without times.lua only the
+-- allocations are compared, and without allocs.lua nothing is run.
+
+geoip = require "geoip"
+local fixture = require "fixture"
+
+local N = 50000		-- lookups per run
+local RUNS = 3		-- runs per scenario; the fastest one counts
+local TOLERANCE = 0.25
+local BATCH = 1000	-- as in test/perf-baseline.lua
+
+local write = arg[1] == "-w"
+local allocs_path = arg[write and 2 or 1]
+local times_path = arg[write and 3 or 2]
+if not allocs_path or (write and not times_path) then
+    error("usage: check perf.lua [-w] allocs.lua [times.lua]", 0)
+end
+
+-- the baseline at path, or nil if there is none
+local function read_baseline(path)
+    local f = path and io.open(path)
+    if not f then return nil end
+    f:close()
+    return dofile(path)
+end
+
+local allowed = read_baseline(allocs_path)
+if not allowed and not write then
+    print("skipped: no allocation baseline " .. allocs_path)
+    return
+end
+local times = not write and read_baseline(times_path)
+if not write and not times then
+    print("no recorded times" .. (times_path and " in " .. times_path or "")
+	.. "; comparing allocations only (see make perf-baseline)")
+end
+
+local path = fixture.write(os.tmpname())
+local image = os.tmpname()
+geoip.open(path, { cache="memory", index="flat" }):save_image(image)
+
+-- N addresses that cycle through the fixture, as strings and numbers, and
+-- sorted batches for lookup_sorted
+local ips, ipnums, batches, sorted = {}, {}, {}, {}
+for i = 1, N do
+    ips[i] = fixture.addresses[(i - 1) % #fixture.addresses + 1][1]
+    ipnums[i] = fixture.ipnum(ips[i])
+end
+for i = 1, N, BATCH do
+    local batch = {}
+    for j = i, math.min(i + BATCH - 1, N) do batch[#batch + 1] = ips[j] end
+    batches[#batches + 1] = batch
+    local s = { unpack(batch) }
+    table.sort(s, function(x, y)
+	return fixture.ipnum(x) < fixture.ipnum(y)
+    end)
+    sorted[#sorted + 1] = s
+end
+
+local modes = {
+    { "standard", { cache="standard" } },
+    { "memory", { cache="memory" } },
+    { "mmap", { cache="mmap" } },
+    { "flat", { cache="memory", index="flat" } },
+    { "image" },
+}
+
+-- each runs N lookups on the GeoIP object g
+local apis = {
+    { "lookup", function(g)
+	for i = 1, N do g:lookup(ips[i]) end
+    end },
+    { "lookup_ipnum", function(g)
+	for i = 1, N do g:lookup_ipnum(ipnums[i]) end
+    end },
+    { "lookup_into", function(g, r)
+	for i = 1, N do g:lookup_into(r, ips[i]) end
+    end },
+    { "prepare", function(g, r, q)
+	for i = 1, N do q(ips[i]) end
+    end },
+    { "format", function(g)
+	for i = 1, N do g:format(ips[i], "%country_code%") end
+    end },
+    { "id", function(g)
+	for i = 1, N do g:id(ipnums[i]) end
+    end },
+    { "lookup_many", function(g)
+	for i = 1, #batches do g:lookup_many(batches[i]) end
+    end },
+    { "lookup_sorted", function(g)
+	for i = 1, #sorted do g:lookup_sorted(sorted[i]) end
+    end },
+    { "threads", function(g)
+	for i = 1, #batches do g:lookup_many(batches[i], { threads=4 }) end
+    end, shared=true },
+}
+
+-- ns and allocations per lookup; the fastest run counts
+local function measure(f, ...)
+    local best, allocs = math.huge
+    for run = 1, RUNS do
+	collectgarbage("collect")
+	local n0, t0 = check.allocations(), check.clock()
+	f(...)
+	local t = check.clock() - t0
+	allocs = (check.allocations() - n0) / N
+	best = math.min(best, t)
+    end
+    return best / N * 1e9, allocs
+end
+
+local results, keys = {}, {}
+for _, mode in ipairs(modes) do
+    local g = mode[2] and geoip.open(path, mode[2]) or geoip.open_image(image)
+    local r = assert(g:lookup("1.2.3.4"), "fixture not readable")
+    local q = g:prepare{ "country_code" }
+    for _, api in ipairs(apis) do
+	if not api.shared or mode[1] ~= "standard" then
+	    local key = mode[1] .. " " .. api[1]
+	    local ns, allocs = measure(api[2], g, r, q)
+	    results[key] = { ns=ns, allocs=allocs }
+	    keys[#keys + 1] = key
+	    print(string.format("%-24s %10.1f ns %8.3f allocations", key, ns,
+		allocs))
+	end
+    end
+end
+os.remove(path)
+os.remove(image)
+
+if write then
+    local f = assert(io.open(times_path, "w"))
+    f:write("-- times of test/perf.lua on this machine, ns per lookup\n"
+	.. "return {\n")
+    for _, key in ipairs(keys) do
+	f:write(string.format("    [%q] = %.1f,\n", key, results[key].ns))
+    end
+    f:write("}\n")
+    f:close()
+    print("times written to " .. times_path)
+    return
+end
+
+local failed = 0
+for _, key in ipairs(keys) do
+    local r, api = results[key], key:match(" (.*)")
+    local a, t = allowed[api], times and times[key]
+    if not a then
+	print(key .. ": " .. api .. " not in " .. allocs_path)
+	failed = failed + 1
+    elseif r.allocs > a + 0.001 then
+	print(string.format("%s: %.3f allocations, allowed %.3f", key,
+	    r.allocs, a))
+	failed = failed + 1
+    end
+    if times and not t then
+	print(key .. ": not in " .. times_path .. "; record it again")
+	failed = failed + 1
+    elseif t and r.ns > t * (1 + TOLERANCE) then
+	print(string.format("%s: %.1f ns, recorded %.1f ns", key, r.ns, t))
+	failed = failed + 1
+    end
+end
+if failed > 0 then
+    error(failed .. " scenarios regressed", 0)
+end
+print("no regressions")